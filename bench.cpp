@@ -0,0 +1,342 @@
+#include "common.h"
+#include "scene.h"
+#include "raytracer.h"
+#include "kdtree.h"
+#include "photon_map.h"
+
+// Microbenchmarks of the photon mapper's hot kernels on the Cornell box. Every case builds its
+// inputs from BENCH_SEED, so runs differ only in timing. Build with
+//     g++ -std=c++20 -fopenmp -O3 bench.cpp -o photon_bench
+
+const uint64_t BENCH_SEED = 1;
+const int BENCH_RAYS = 4096;
+const int BENCH_QUERIES = 1024;
+const int BENCH_PATHS = 1024;
+
+struct BenchOptions {
+    std::string filter;
+    double min_time = 0.5;
+    int repetitions = 3;
+    std::string json_file;
+};
+
+struct BenchResult {
+    std::string name;
+    long iterations;
+    double ns_per_op;
+    double items_per_second;
+};
+
+BenchOptions bench_options;
+std::vector<BenchResult> bench_results;
+volatile float bench_sink; // Results are added here so the compiler cannot drop the work
+
+bool bench_selected(const std::string &name) {
+    return name.find(bench_options.filter) != std::string::npos;
+}
+
+// Times op, which processes items_per_op items per call. The iteration count doubles until a run
+// takes --min-time seconds, then the median of --repetitions runs of that many iterations is reported.
+template<typename Op>
+void run_benchmark(const std::string &name, double items_per_op, Op op) {
+    auto time_runs = [&](long iterations) {
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) op();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    seed_random(BENCH_SEED);
+    op(); // Warm up caches and allocations
+    long iterations = 1;
+    for (double elapsed = time_runs(1); elapsed < bench_options.min_time; elapsed = time_runs(iterations)) {
+        iterations = std::max(2 * iterations, (long)(1.2 * iterations * bench_options.min_time / std::max(elapsed, 1e-9)));
+    }
+
+    std::vector<double> seconds;
+    for (int r = 0; r < bench_options.repetitions; r++) {
+        seed_random(BENCH_SEED);
+        seconds.push_back(time_runs(iterations));
+    }
+    std::sort(seconds.begin(), seconds.end());
+    double median = seconds[seconds.size() / 2];
+
+    BenchResult result{name, iterations, 1e9 * median / iterations, items_per_op * iterations / median};
+    bench_results.push_back(result);
+    cout << std::left << std::setw(36) << name << std::right << std::setw(14) << std::fixed << std::setprecision(1)
+         << result.ns_per_op << " ns/op" << std::setw(14) << std::scientific << std::setprecision(3)
+         << result.items_per_second << " items/s" << std::defaultfloat << "   (" << iterations << " iterations)" << endl;
+}
+
+// Bounds of the Cornell box triangles, shrunk a little so that ray origins lie inside the box
+void scene_bounds(Vec3f &min_dim, Vec3f &max_dim) {
+    min_dim = Vec3f{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__};
+    max_dim = -min_dim;
+    for (const SceneElement &ele : scene.scene_elements) {
+        if (ele.type != TRIANGLE) continue;
+        for (Vec3f p : {ele.p1, ele.p2, ele.p3}) {
+            min_dim = min(min_dim, p);
+            max_dim = max(max_dim, p);
+        }
+    }
+    Vec3f margin = 0.05f * (max_dim - min_dim);
+    min_dim += margin;
+    max_dim -= margin;
+}
+
+Vec3f sample_unit_sphere() {
+    float z = 1 - 2 * random_uniform();
+    float r = sqrtf(std::max(0.0f, 1 - z * z));
+    float phi = 2 * PI * random_uniform();
+    return Vec3f{r * cosf(phi), r * sinf(phi), z};
+}
+
+// Rays from uniform points inside the box in uniform directions
+void random_rays(int n, std::vector<Vec3f> &origins, std::vector<Vec3f> &directions) {
+    Vec3f min_dim, max_dim;
+    scene_bounds(min_dim, max_dim);
+    origins.resize(n);
+    directions.resize(n);
+    for (int i = 0; i < n; i++) {
+        origins[i] = min_dim + Vec3f{random_uniform(), random_uniform(), random_uniform()} * (max_dim - min_dim);
+        directions[i] = sample_unit_sphere();
+    }
+}
+
+// Traces photons from the light until the diffuse map, or the caustic map when caustic is set, holds
+// n photons. Caustic photons are emitted through the projection map as in map_photons, so they
+// cluster under the glass spheres while diffuse photons cover every surface.
+std::vector<Photon> trace_photon_map(size_t n, bool caustic) {
+    seed_random(BENCH_SEED);
+    photon_budget = PhotonBudget();
+    diffuse_photons.clear();
+    caustic_photons.clear();
+    ProjectionMap projection_map(PROJECTION_MAP_RESOLUTION, PROJECTION_MAP_PATCHES);
+    if (caustic) projection_map.build();
+
+    std::vector<Photon> &photons = caustic ? caustic_photons : diffuse_photons;
+    while (photons.size() < n) {
+        Vec3f light_position, ray_direction;
+        int light;
+        if (caustic) {
+            light = projection_map.sample(light_position, ray_direction);
+        } else {
+            light = sample_light();
+            light_position = sample_light_position(scene.lights[light]);
+            ray_direction = from_local(sample_unit_hemisphere(), scene.lights[light].normal);
+        }
+        Vec3f ray_origin = offset_ray_origin(light_position, scene.lights[light].normal);
+        float power = total_light_power();
+        photon_trace(PhotonState{.origin = ray_origin, .direction = ray_direction, .power = Vec3f{power, power, power}, .caustic_pass = caustic});
+    }
+
+    std::vector<Photon> result(photons.begin(), photons.begin() + n);
+    diffuse_photons.clear();
+    caustic_photons.clear();
+    return result;
+}
+
+// Points where camera rays first meet a diffuse surface, the places the renderer gathers photons
+void gather_points(int n, std::vector<Vec3f> &points, std::vector<int> &surface_indices) {
+    seed_random(BENCH_SEED);
+    points.clear();
+    surface_indices.clear();
+    while ((int)points.size() < n) {
+        Vec3f ray_direction = camera_ray_direction(random_uniform(), random_uniform());
+        Hit hit = closest_hit(scene.camera_position, ray_direction, scene.scene_elements, scene.mesh_geometry);
+        if (!hit.found || surface(hit).type != LAMBERTIAN) continue;
+        points.push_back(scene.camera_position + hit.t * ray_direction);
+        surface_indices.push_back(hit.surface_index);
+    }
+}
+
+// The renderer keeps its trees for the whole run and never frees them
+void free_kd_nodes(KDTree* node) {
+    if (node == nullptr) return;
+    free_kd_nodes(node->left);
+    free_kd_nodes(node->right);
+    delete node;
+}
+
+void bench_kd_balance() {
+    for (int n : {10000, 100000, 1000000}) {
+        std::string name = "kd_balance/" + std::to_string(n);
+        if (!bench_selected(name)) continue;
+        std::vector<Photon> photons = trace_photon_map(n, false);
+        // Each tree is freed before the next one is built, so memory stays bounded. The frees are
+        // timed too, but cost little next to the allocations of the balance itself.
+        run_benchmark(name, n, [&]() {
+            KDTree kd(&photons);
+            kd.balance();
+            bench_sink = bench_sink + kd.photon_index;
+            free_kd_nodes(kd.left);
+            free_kd_nodes(kd.right);
+        });
+    }
+}
+
+void bench_locate_photons() {
+    std::vector<Vec3f> points;
+    std::vector<int> surface_indices;
+    gather_points(BENCH_QUERIES, points, surface_indices);
+
+    for (bool caustic : {false, true}) {
+        std::string distribution = caustic ? "caustic" : "diffuse";
+        std::vector<int> ks;
+        for (int k : {16, 100, 500}) {
+            if (bench_selected("locate_photons/" + distribution + "/k=" + std::to_string(k))) ks.push_back(k);
+        }
+        if (ks.empty()) continue;
+        std::vector<Photon> photons = trace_photon_map(100000, caustic);
+        KDTree kd(&photons);
+        kd.balance();
+
+        for (int k : ks) {
+            run_benchmark("locate_photons/" + distribution + "/k=" + std::to_string(k), BENCH_QUERIES, [&]() {
+                float sum = 0;
+                for (int i = 0; i < BENCH_QUERIES; i++) {
+                    NNQ nnq;
+                    kd.locate_photons(points[i], k, surface_indices[i], nnq);
+                    if (!nnq.empty()) sum += nnq.top().first;
+                }
+                bench_sink = bench_sink + sum;
+            });
+        }
+    }
+}
+
+void bench_intersection() {
+    seed_random(BENCH_SEED);
+    std::vector<Vec3f> origins, directions;
+    random_rays(BENCH_RAYS, origins, directions);
+
+    std::vector<SceneElement> triangles, spheres;
+    for (const SceneElement &ele : scene.scene_elements) {
+        (ele.type == SPHERE ? spheres : triangles).push_back(ele);
+    }
+
+    if (bench_selected("ray_triangle_intersect")) {
+        run_benchmark("ray_triangle_intersect", (double)BENCH_RAYS * triangles.size(), [&]() {
+            float sum = 0;
+            for (int i = 0; i < BENCH_RAYS; i++) {
+                for (const SceneElement &triangle : triangles) {
+                    auto [hit, t] = ray_triangle_intersect(triangle, origins[i], directions[i]);
+                    if (hit) sum += t;
+                }
+            }
+            bench_sink = bench_sink + sum;
+        });
+    }
+    if (bench_selected("ray_sphere_intersect")) {
+        run_benchmark("ray_sphere_intersect", (double)BENCH_RAYS * spheres.size(), [&]() {
+            float sum = 0;
+            for (int i = 0; i < BENCH_RAYS; i++) {
+                for (const SceneElement &sphere : spheres) {
+                    auto [hit, t] = ray_sphere_intersect(sphere, origins[i], directions[i]);
+                    if (hit) sum += t;
+                }
+            }
+            bench_sink = bench_sink + sum;
+        });
+    }
+    if (bench_selected("closest_hit")) {
+        run_benchmark("closest_hit", BENCH_RAYS, [&]() {
+            float sum = 0;
+            for (int i = 0; i < BENCH_RAYS; i++) {
+                Hit hit = closest_hit(origins[i], directions[i], scene.scene_elements, scene.mesh_geometry);
+                if (hit.found) sum += hit.t;
+            }
+            bench_sink = bench_sink + sum;
+        });
+    }
+}
+
+// Whole photon paths from the light, with their deposits and Russian roulette, one at a time
+void bench_photon_trace() {
+    if (!bench_selected("photon_trace")) return;
+    photon_budget = PhotonBudget();
+    run_benchmark("photon_trace", BENCH_PATHS, [&]() {
+        diffuse_photons.clear();
+        caustic_photons.clear();
+        for (int i = 0; i < BENCH_PATHS; i++) {
+            const Light &light = scene.lights[sample_light()];
+            Vec3f light_position = sample_light_position(light);
+            Vec3f ray_direction = from_local(sample_unit_hemisphere(), light.normal);
+            Vec3f ray_origin = offset_ray_origin(light_position, light.normal);
+            float power = total_light_power();
+            photon_trace(PhotonState{.origin = ray_origin, .direction = ray_direction, .power = Vec3f{power, power, power}});
+        }
+        bench_sink = bench_sink + diffuse_photons.size();
+    });
+    diffuse_photons.clear();
+    caustic_photons.clear();
+}
+
+void write_bench_json(const std::string &path) {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("cannot create " + path);
+    file << std::setprecision(9) << "[";
+    for (size_t i = 0; i < bench_results.size(); i++) {
+        const BenchResult &result = bench_results[i];
+        file << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+             << ", \"ns_per_op\": " << result.ns_per_op << ", \"items_per_second\": " << result.items_per_second << "}";
+    }
+    file << "\n]\n";
+    if (!file) throw std::runtime_error("failed writing " + path);
+}
+
+void print_bench_usage(char const * program) {
+    cout << "Usage: " << program << " [options]" << endl;
+    cout << "  --filter TEXT                   only run cases whose name contains TEXT" << endl;
+    cout << "  --min-time SECONDS              minimum duration of each timed run (default 0.5)" << endl;
+    cout << "  --repetitions N                 timed runs per case, the median is reported (default 3)" << endl;
+    cout << "  --json FILE                     also write the results to FILE as JSON" << endl;
+}
+
+double parse_bench_number(char const * program, const std::string &arg, const std::string &value) {
+    try {
+        size_t end;
+        double number = std::stod(value, &end);
+        if (end == value.size() && number > 0) return number;
+    } catch (const std::exception &) {}
+    cout << "Invalid value for " << arg << ": '" << value << "'" << endl;
+    print_bench_usage(program);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--filter" && !value.empty()) {
+            bench_options.filter = value;
+            i++;
+        } else if (arg == "--min-time" && !value.empty()) {
+            bench_options.min_time = parse_bench_number(argv[0], arg, value);
+            i++;
+        } else if (arg == "--repetitions" && !value.empty()) {
+            bench_options.repetitions = std::max(1, (int)parse_bench_number(argv[0], arg, value));
+            i++;
+        } else if (arg == "--json" && !value.empty()) {
+            bench_options.json_file = value;
+            i++;
+        } else {
+            print_bench_usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    bench_kd_balance();
+    bench_locate_photons();
+    bench_intersection();
+    bench_photon_trace();
+
+    if (!bench_options.json_file.empty()) {
+        try {
+            write_bench_json(bench_options.json_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to write results: " << e.what() << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
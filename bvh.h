@@ -0,0 +1,184 @@
+#pragma once
+
+#include "common.h"
+
+// Flat bounding volume hierarchy over indexed triangles. Interior nodes have count == 0 and
+// their children at first and first + 1; leaves reference count entries of the triangle list.
+struct BVHNode {
+    Vec3f bounds_min;
+    uint32_t first;
+    Vec3f bounds_max;
+    uint32_t count;
+};
+
+const int BVH_BINS = 16;
+const int BVH_MAX_LEAF_SIZE = 4;
+// Below this depth nodes are split at the median, which halves the triangles of 32-bit indexed
+// meshes at most 32 more times. Traversal stacks hold one entry per level plus the last pair.
+const int BVH_SAH_MAX_DEPTH = 32;
+const int BVH_MAX_DEPTH = BVH_SAH_MAX_DEPTH + 32;
+const int BVH_STACK_SIZE = BVH_MAX_DEPTH + 2;
+
+struct BVHBuilder {
+    const Vec3f* vertices;
+    const uint32_t* indices;
+    std::vector<Vec3f> centroids;
+    std::vector<Vec3f> triangle_min;
+    std::vector<Vec3f> triangle_max;
+    std::vector<BVHNode> &nodes;
+    std::vector<uint32_t> &triangles;
+
+    void build(uint32_t node_index, uint32_t begin, uint32_t end, int depth);
+    void build_children(uint32_t node_index, uint32_t begin, uint32_t middle, uint32_t end, int depth);
+};
+
+float surface_area(Vec3f bounds_min, Vec3f bounds_max) {
+    Vec3f d = max(bounds_max - bounds_min, Vec3f{0, 0, 0});
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Binned SAH split of triangles[begin, end), falling back to a median split when the
+// centroids cannot be separated by the bins or the node is deeper than BVH_SAH_MAX_DEPTH
+void BVHBuilder::build(uint32_t node_index, uint32_t begin, uint32_t end, int depth) {
+    Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__}, bounds_max = -bounds_min;
+    Vec3f centroid_min = bounds_min, centroid_max = bounds_max;
+    for (uint32_t i = begin; i < end; i++) {
+        uint32_t tri = triangles[i];
+        bounds_min = min(bounds_min, triangle_min[tri]);
+        bounds_max = max(bounds_max, triangle_max[tri]);
+        centroid_min = min(centroid_min, centroids[tri]);
+        centroid_max = max(centroid_max, centroids[tri]);
+    }
+    nodes[node_index].bounds_min = bounds_min;
+    nodes[node_index].bounds_max = bounds_max;
+
+    uint32_t count = end - begin;
+    Vec3f extent = centroid_max - centroid_min;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+
+    if (count <= BVH_MAX_LEAF_SIZE || extent[axis] <= 0) {
+        nodes[node_index].first = begin;
+        nodes[node_index].count = count;
+        return;
+    }
+
+    uint32_t middle;
+    if (depth >= BVH_SAH_MAX_DEPTH) {
+        middle = begin + count / 2;
+        std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end, [&](uint32_t a, uint32_t b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+        build_children(node_index, begin, middle, end, depth);
+        return;
+    }
+
+    struct Bin {
+        Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__};
+        Vec3f bounds_max{-__FLT_MAX__, -__FLT_MAX__, -__FLT_MAX__};
+        uint32_t count = 0;
+    } bins[BVH_BINS];
+
+    float bin_scale = BVH_BINS / extent[axis];
+    auto bin_of = [&](uint32_t tri) {
+        return std::min((int)((centroids[tri][axis] - centroid_min[axis]) * bin_scale), BVH_BINS - 1);
+    };
+    for (uint32_t i = begin; i < end; i++) {
+        Bin &bin = bins[bin_of(triangles[i])];
+        bin.bounds_min = min(bin.bounds_min, triangle_min[triangles[i]]);
+        bin.bounds_max = max(bin.bounds_max, triangle_max[triangles[i]]);
+        bin.count++;
+    }
+
+    // Sweep from the right for the cost of every right side, then from the left
+    float right_cost[BVH_BINS];
+    Bin right;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+        right.bounds_min = min(right.bounds_min, bins[b].bounds_min);
+        right.bounds_max = max(right.bounds_max, bins[b].bounds_max);
+        right.count += bins[b].count;
+        right_cost[b] = right.count * surface_area(right.bounds_min, right.bounds_max);
+    }
+    int best_split = -1;
+    float best_cost = count * surface_area(bounds_min, bounds_max);
+    Bin left;
+    for (int b = 0; b < BVH_BINS - 1; b++) {
+        left.bounds_min = min(left.bounds_min, bins[b].bounds_min);
+        left.bounds_max = max(left.bounds_max, bins[b].bounds_max);
+        left.count += bins[b].count;
+        float cost = left.count * surface_area(left.bounds_min, left.bounds_max) + right_cost[b + 1];
+        if (left.count > 0 && left.count < count && cost < best_cost) {
+            best_cost = cost;
+            best_split = b;
+        }
+    }
+
+    if (best_split >= 0) {
+        middle = std::partition(triangles.begin() + begin, triangles.begin() + end, [&](uint32_t tri) {
+            return bin_of(tri) <= best_split;
+        }) - triangles.begin();
+    } else {
+        middle = begin + count / 2;
+        std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end, [&](uint32_t a, uint32_t b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+    }
+
+    build_children(node_index, begin, middle, end, depth);
+}
+
+void BVHBuilder::build_children(uint32_t node_index, uint32_t begin, uint32_t middle, uint32_t end, int depth) {
+    uint32_t first_child = nodes.size();
+    nodes.push_back(BVHNode{});
+    nodes.push_back(BVHNode{});
+    nodes[node_index].first = first_child;
+    nodes[node_index].count = 0;
+    build(first_child, begin, middle, depth + 1);
+    build(first_child + 1, middle, end, depth + 1);
+}
+
+void build_bvh(const Vec3f* vertices, const uint32_t* indices, uint32_t num_triangles, std::vector<BVHNode> &nodes, std::vector<uint32_t> &triangles) {
+    nodes.clear();
+    triangles = std::vector<uint32_t>(num_triangles);
+    std::iota(triangles.begin(), triangles.end(), 0);
+    if (num_triangles == 0) return;
+
+    BVHBuilder builder{vertices, indices, std::vector<Vec3f>(num_triangles), std::vector<Vec3f>(num_triangles), std::vector<Vec3f>(num_triangles), nodes, triangles};
+    #pragma omp parallel for
+    for (uint32_t tri = 0; tri < num_triangles; tri++) {
+        Vec3f p1 = vertices[indices[3 * tri]], p2 = vertices[indices[3 * tri + 1]], p3 = vertices[indices[3 * tri + 2]];
+        builder.triangle_min[tri] = min(p1, min(p2, p3));
+        builder.triangle_max[tri] = max(p1, max(p2, p3));
+        builder.centroids[tri] = (p1 + p2 + p3) / 3.0f;
+    }
+
+    nodes.reserve(2 * num_triangles / BVH_MAX_LEAF_SIZE + 1);
+    nodes.push_back(BVHNode{});
+    builder.build(0, 0, num_triangles, 0);
+}
+
+// Depth of the deepest leaf, or -1 for a tree deeper than BVH_MAX_DEPTH or with children that are not
+// stored in nodes after their parent, which traversal cannot walk safely
+int bvh_depth(const BVHNode* nodes, uint64_t num_nodes) {
+    if (num_nodes == 0) return 0;
+    int depth = 0;
+    std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        auto [node, node_depth] = stack.back();
+        stack.pop_back();
+        depth = std::max(depth, node_depth);
+        if (nodes[node].count > 0) continue;
+        if ((uint64_t)nodes[node].first + 1 >= num_nodes || nodes[node].first <= node || node_depth >= BVH_MAX_DEPTH) return -1;
+        stack.push_back({nodes[node].first, node_depth + 1});
+        stack.push_back({nodes[node].first + 1, node_depth + 1});
+    }
+    return depth;
+}
+
+// Slab test, returning the entry distance along the ray or __FLT_MAX__ on a miss
+float ray_box_intersect(const BVHNode &node, const Vec3f &ray_origin, const Vec3f &inv_direction, float t_max) {
+    Vec3f t1 = (node.bounds_min - ray_origin) * inv_direction;
+    Vec3f t2 = (node.bounds_max - ray_origin) * inv_direction;
+    float t_near = maxelem(min(t1, t2));
+    float t_far = minelem(max(t1, t2));
+    return t_near <= t_far && t_far > 0 && t_near < t_max ? t_near : __FLT_MAX__;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <fstream>
+#include <stdexcept>
+
+#include "common.h"
+#include "scene.h"
+
+// Camera placement; the scene is z-up and the default view looks down -y
+struct CameraPose {
+    Vec3f position;
+    Vec3f target;
+    float vertical_fov; // Degrees
+};
+
+// Pixel rectangle [x0, x1) x [y0, y1) of the image, with y0 = 0 the top row
+struct ImageRegion {
+    int x0, y0, x1, y1;
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+};
+
+// Field of view of the image plane currently set in scene
+float scene_vertical_fov() {
+    return 2 * atanf(0.5f * length(scene.ip_up_vector) / scene.focal_distance) * 180 / PI;
+}
+
+// Pose that reproduces the camera and image plane currently set in scene
+CameraPose scene_camera_pose() {
+    Vec3f forward = normalize(cross(scene.ip_up_vector, scene.ip_right_vector));
+    return CameraPose{scene.camera_position, scene.camera_position + forward, scene_vertical_fov()};
+}
+
+// Moves the camera and rebuilds the image plane at the focal distance, keeping the image aspect ratio
+void look_at(const CameraPose &pose) {
+    Vec3f forward = normalize(pose.target - pose.position);
+    Vec3f right = normalize(cross(forward, Vec3f{0.0f, 0.0f, 1.0f}));
+    Vec3f up = cross(right, forward);
+    float height = 2 * scene.focal_distance * tanf(0.5f * pose.vertical_fov * PI / 180);
+    float width = height * scene.image_width / scene.image_height;
+
+    scene.camera_position = pose.position;
+    scene.ip_right_vector = width * right;
+    scene.ip_up_vector = height * up;
+    scene.ip_bottom_left = pose.position + scene.focal_distance * forward - 0.5f * scene.ip_right_vector - 0.5f * scene.ip_up_vector;
+}
+
+// One pose per line as "px py pz tx ty tz [fov]"; the field of view defaults to the scene's and '#' starts a comment
+std::vector<CameraPose> load_camera_path(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("cannot open " + path);
+
+    std::vector<CameraPose> poses;
+    std::string line;
+    for (int line_number = 1; std::getline(file, line); line_number++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream stream(line);
+        CameraPose pose{.vertical_fov = scene_vertical_fov()};
+        if (!(stream >> pose.position.x)) continue;
+        stream >> pose.position.y >> pose.position.z >> pose.target.x >> pose.target.y >> pose.target.z;
+        if (!stream) throw std::runtime_error(path + ":" + std::to_string(line_number) + ": expected px py pz tx ty tz [fov]");
+        if (!(stream >> pose.vertical_fov)) pose.vertical_fov = scene_vertical_fov();
+        Vec3f forward = pose.target - pose.position;
+        if (length2(cross(forward, Vec3f{0.0f, 0.0f, 1.0f})) <= 1e-8f * length2(forward) || pose.vertical_fov <= 0 || pose.vertical_fov >= 180) {
+            throw std::runtime_error(path + ":" + std::to_string(line_number) + ": degenerate camera pose");
+        }
+        poses.push_back(pose);
+    }
+    if (poses.empty()) throw std::runtime_error(path + ": no camera poses");
+    return poses;
+}
+
+Vec3f catmull_rom(Vec3f p0, Vec3f p1, Vec3f p2, Vec3f p3, float t) {
+    return 0.5f * (2 * p1 + t * (p2 - p0) + t * t * (2 * p0 - 5 * p1 + 4 * p2 - p3) + t * t * t * (3 * p1 - p0 - 3 * p2 + p3));
+}
+
+// num_frames poses spread evenly over the keyframes, passing through each of them
+std::vector<CameraPose> interpolate_camera_path(const std::vector<CameraPose> &keyframes, int num_frames) {
+    std::vector<CameraPose> poses(num_frames, keyframes[0]);
+    int last = keyframes.size() - 1;
+    if (last == 0) return poses;
+
+    for (int frame = 0; frame < num_frames; frame++) {
+        float position = num_frames > 1 ? (float)frame * last / (num_frames - 1) : 0;
+        int k = std::min((int)position, last - 1);
+        float t = position - k;
+        const CameraPose &k0 = keyframes[std::max(k - 1, 0)];
+        const CameraPose &k1 = keyframes[k];
+        const CameraPose &k2 = keyframes[k + 1];
+        const CameraPose &k3 = keyframes[std::min(k + 2, last)];
+        poses[frame].position = catmull_rom(k0.position, k1.position, k2.position, k3.position, t);
+        poses[frame].target = catmull_rom(k0.target, k1.target, k2.target, k3.target, t);
+        poses[frame].vertical_fov = (1 - t) * k1.vertical_fov + t * k2.vertical_fov;
+    }
+    return poses;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+
+#include "common.h"
+
+const char CHECKPOINT_MAGIC[8] = {'P', 'M', 'C', 'H', 'K', 'P', 'T', '\0'};
+const uint32_t CHECKPOINT_VERSION = 1;
+
+// Progress of a frame rendered in passes of pass_spp samples. Pixels are seeded from the seed, their
+// position and the pass, so the seed, the accumulated radiance, the per-pixel sample counts and the
+// next band to render are all it takes to continue exactly where a render stopped. The photon maps
+// are traced again from the same seed, or loaded from a photon cache.
+struct RenderCheckpoint {
+    uint64_t seed = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t spp = 0;
+    int32_t pass_spp = 0;
+    int32_t next_pass = 0;
+    int32_t next_row = 0;
+    std::vector<Vec3f> radiance; // Sum over all samples taken so far
+    std::vector<uint32_t> samples;
+
+    void write(const std::string &path) const;
+    void read(const std::string &path);
+};
+
+// Written to a temporary name first, so that an interruption mid-write keeps the previous checkpoint
+void RenderCheckpoint::write(const std::string &path) const {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file) throw std::runtime_error("cannot create " + temporary);
+        uint32_t pixel_stride = sizeof(Vec3f);
+        file.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        file.write((const char*)&CHECKPOINT_VERSION, sizeof(CHECKPOINT_VERSION));
+        file.write((const char*)&pixel_stride, sizeof(pixel_stride));
+        file.write((const char*)&seed, sizeof(seed));
+        for (int32_t value : {width, height, spp, pass_spp, next_pass, next_row}) file.write((const char*)&value, sizeof(value));
+        file.write((const char*)radiance.data(), radiance.size() * sizeof(Vec3f));
+        file.write((const char*)samples.data(), samples.size() * sizeof(uint32_t));
+        if (!file) throw std::runtime_error("failed writing " + temporary);
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) throw std::runtime_error("cannot rename " + temporary + " to " + path);
+}
+
+void RenderCheckpoint::read(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot open " + path);
+    char magic[8];
+    uint32_t version, pixel_stride;
+    file.read(magic, sizeof(magic));
+    file.read((char*)&version, sizeof(version));
+    file.read((char*)&pixel_stride, sizeof(pixel_stride));
+    if (!file || memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 || version != CHECKPOINT_VERSION) {
+        throw std::runtime_error(path + ": not a render checkpoint");
+    }
+    if (pixel_stride != sizeof(Vec3f)) throw std::runtime_error(path + ": written by a build with a different pixel layout");
+
+    file.read((char*)&seed, sizeof(seed));
+    for (int32_t* value : {&width, &height, &spp, &pass_spp, &next_pass, &next_row}) file.read((char*)value, sizeof(*value));
+    if (!file || width <= 0 || height <= 0 || spp <= 0 || pass_spp <= 0 || next_pass < 0 || next_row < 0 || next_row > height) {
+        throw std::runtime_error(path + ": corrupt checkpoint");
+    }
+    radiance.resize((size_t)width * height);
+    samples.resize((size_t)width * height);
+    file.read((char*)radiance.data(), radiance.size() * sizeof(Vec3f));
+    file.read((char*)samples.data(), samples.size() * sizeof(uint32_t));
+    if (!file) throw std::runtime_error(path + ": truncated checkpoint");
+}
@@ -13,16 +13,23 @@
 #include <cmath>
 #include <numeric>
 #include <queue>
+#include <iomanip>
+#include <thread>
 #include <future>
 #include <omp.h>
 
 #include "linalg.h"
+#ifdef USE_SIMD_VEC
+#include "linalg_simd.h"
+#endif
 
 using Vec2f = linalg::vec<float, 2>;
 using Vec3f = linalg::vec<float, 3>;
 using Vec4f = linalg::vec<float, 4>;
 using std::cout, std::endl;
-std::mt19937 rng(std::chrono::steady_clock::now().time_since_epoch().count());
+// Every thread draws from its own generator; random_seed is what --seed sets for the photon passes
+uint64_t random_seed = std::chrono::steady_clock::now().time_since_epoch().count();
+thread_local std::mt19937 rng(random_seed ^ std::hash<std::thread::id>()(std::this_thread::get_id()));
 float PI = 4 * atanf(1);
 
 std::ostream& operator<<(std::ostream &os, const Vec3f v) {
@@ -31,6 +38,7 @@ std::ostream& operator<<(std::ostream &os, const Vec3f v) {
 
 const int TRIANGLE = 0;
 const int SPHERE = 1;
+const int MESH_TRIANGLE = 2;
 
 struct SceneElement {
     int type;
@@ -52,18 +60,64 @@ std::ostream& operator<<(std::ostream &os, const T_container &v) {
     return os << '}';
 }
 
+uint64_t mix_bits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Restarts the calling thread's generator on one stream of seed, e.g. one per pixel so that a pixel
+// draws the same numbers however the image is split between threads and processes
+void seed_random(uint64_t seed, uint64_t stream = 0) {
+    rng.seed((uint32_t)mix_bits(mix_bits(seed) ^ stream));
+}
+
 float random_uniform() {
     return std::uniform_real_distribution<float>(0,1)(rng);
 }
 
+Vec3f sample_unit_hemisphere(float r1, float r2) {
+    float theta = 2 * PI * r1;
+    float phi = acosf(sqrtf(1 - r2));
+
+    return Vec3f{sinf(phi) * cosf(theta), sinf(phi) * sinf(theta), cosf(phi)};
+}
+
 Vec3f sample_unit_hemisphere() {
     float r1 = random_uniform();
     float r2 = random_uniform();
+    return sample_unit_hemisphere(r1, r2);
+}
 
-    float theta = 2 * PI * r1;
-    float phi = acosf(sqrtf(1 - r2));
+// Spreads the low 10 bits of v so that there are two zero bits between each of them
+uint32_t expand_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
 
-    return Vec3f{sinf(phi) * cosf(theta), sinf(phi) * sinf(theta), cosf(phi)};
+// 30 bit Morton code of a point with coordinates in [0, 1]
+uint32_t morton_code(Vec3f v) {
+    Vec3f q = clamp(v * 1024.0f, 0.0f, 1023.0f);
+    return (expand_bits((uint32_t)q.x) << 2) | (expand_bits((uint32_t)q.y) << 1) | expand_bits((uint32_t)q.z);
+}
+
+// Spreads the low 16 bits of v so that there is a zero bit between each of them
+uint32_t expand_bits_2d(uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// 32 bit Morton code of integer coordinates below 65536
+uint32_t morton_code_2d(uint32_t x, uint32_t y) {
+    return (expand_bits_2d(y) << 1) | expand_bits_2d(x);
 }
 
 Vec3f offset_ray_origin(Vec3f ray_position, Vec3f normal) {
@@ -99,6 +153,18 @@ struct Photon {
     int surface_id;
 };
 
+// In-flight photon between bounces. diffuse and caustic record which kinds of surface the path
+// has already scattered off, caustic_pass marks photons emitted through the projection map.
+struct PhotonState {
+    Vec3f origin;
+    Vec3f direction;
+    Vec3f power;
+    bool diffuse = false;
+    bool caustic = false;
+    bool caustic_pass = false;
+    int depth = 0;
+};
+
 float ETA_1 = 1.000293f;
 float ETA_2 = 2.058f;
 
@@ -109,7 +175,7 @@ Vec3f photon_refract(Vec3f omega, Vec3f normal, bool entering = true) {
     return -1.0f * (a + b);
 }
 
-Vec3f normal_sphere(SceneElement sphere, Vec3f position) {
+Vec3f normal_sphere(const SceneElement &sphere, Vec3f position) {
     Vec3f normal = position - sphere.p1;
     return normalize(normal);
 }
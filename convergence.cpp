@@ -0,0 +1,363 @@
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+
+#include "common.h"
+
+// Equal-time convergence benchmark and golden-image regression harness. It runs the renderer on
+// every scene of a suite under every configuration, at each sample count of the sweep, and
+// measures each image's error against a high-sample reference of the scene rendered from another
+// seed, so photon map noise counts too. Error against wall-clock time is written to curves.csv.
+// The render at the golden sample count must stay within the suite's tolerance of the stored
+// golden image and within its time budget. Build with
+//     g++ -std=c++20 -fopenmp -O2 convergence.cpp -o photon_convergence
+
+// A scene or a configuration: a name and the renderer arguments that select it
+struct SuiteEntry {
+    std::string name;
+    std::string args = "";
+    float time_budget = 0;
+};
+
+// Suite file, one directive per line, '#' starts a comment:
+//     renderer PATH                    renderer executable (default ./photon_mapper)
+//     resolution W H                   image size of every render (default 128 128)
+//     seed N                           seed of the measured renders, the reference uses N + 1 (default 1)
+//     reference ARGS                   renderer arguments of the references (default --spp 4096)
+//     scene NAME [ARGS]                a scene, any number of them
+//     config NAME [budget=S] [ARGS]    a configuration, with its time budget at the golden sample count
+//     spp N...                         sample counts of the sweep (default 1 4 16 64)
+//     golden SPP TOLERANCE             sample count and largest RMSE against the golden image (default 16 0.001)
+//     equal-time SECONDS...            times at which configurations are compared (default: the longest
+//                                      time every configuration of a scene reached)
+struct Suite {
+    std::string renderer = "./photon_mapper";
+    int width = 128;
+    int height = 128;
+    long seed = 1;
+    std::string reference_args = "--spp 4096";
+    std::vector<SuiteEntry> scenes;
+    std::vector<SuiteEntry> configs;
+    std::vector<int> spps = {1, 4, 16, 64};
+    int golden_spp = 16;
+    float golden_tolerance = 1e-3f;
+    std::vector<float> equal_times;
+};
+
+std::string rest_of_line(std::istringstream &stream) {
+    std::string rest;
+    std::getline(stream, rest);
+    rest.erase(0, rest.find_first_not_of(" \t"));
+    return rest;
+}
+
+Suite read_suite(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("cannot open " + path);
+
+    Suite suite;
+    std::string line;
+    for (int line_number = 1; std::getline(file, line); line_number++) {
+        std::istringstream stream(line.substr(0, line.find('#')));
+        std::string directive;
+        if (!(stream >> directive)) continue;
+        bool valid = true;
+        if (directive == "renderer") {
+            valid = (bool)(stream >> suite.renderer);
+        } else if (directive == "resolution") {
+            valid = stream >> suite.width >> suite.height && suite.width > 0 && suite.height > 0;
+        } else if (directive == "seed") {
+            valid = stream >> suite.seed && suite.seed > 0;
+        } else if (directive == "reference") {
+            suite.reference_args = rest_of_line(stream);
+        } else if (directive == "scene" || directive == "config") {
+            SuiteEntry entry;
+            valid = (bool)(stream >> entry.name);
+            std::string args = rest_of_line(stream);
+            if (directive == "config" && args.rfind("budget=", 0) == 0) {
+                size_t end = args.find_first_of(" \t");
+                entry.time_budget = std::atof(args.substr(7, end - 7).c_str());
+                args = end == std::string::npos ? "" : args.substr(args.find_first_not_of(" \t", end));
+                valid = valid && entry.time_budget > 0;
+            }
+            entry.args = args;
+            (directive == "scene" ? suite.scenes : suite.configs).push_back(entry);
+        } else if (directive == "spp") {
+            suite.spps.clear();
+            for (int spp; stream >> spp;) suite.spps.push_back(spp);
+            valid = !suite.spps.empty() && *std::min_element(suite.spps.begin(), suite.spps.end()) > 0;
+        } else if (directive == "golden") {
+            valid = stream >> suite.golden_spp >> suite.golden_tolerance && suite.golden_spp > 0 && suite.golden_tolerance >= 0;
+        } else if (directive == "equal-time") {
+            for (float seconds; stream >> seconds;) suite.equal_times.push_back(seconds);
+        } else {
+            valid = false;
+        }
+        if (!valid) throw std::runtime_error(path + ":" + std::to_string(line_number) + ": invalid line '" + line + "'");
+    }
+    if (suite.scenes.empty()) suite.scenes.push_back(SuiteEntry{"cornell"});
+    if (suite.configs.empty()) suite.configs.push_back(SuiteEntry{"default"});
+    return suite;
+}
+
+// Linear float RGB of a PFM image, in file order
+std::vector<Vec3f> read_pfm(const std::string &path, int width, int height) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot open " + path);
+    std::string magic;
+    int file_width, file_height;
+    float scale;
+    file >> magic >> file_width >> file_height >> scale;
+    file.get();
+    if (!file || magic != "PF") throw std::runtime_error(path + ": not a color PFM image");
+    if (file_width != width || file_height != height) throw std::runtime_error(path + ": wrong resolution");
+
+    std::vector<float> values((size_t)3 * width * height);
+    file.read((char*)values.data(), values.size() * sizeof(float));
+    if (!file) throw std::runtime_error(path + ": truncated image");
+    uint16_t probe = 1;
+    bool little_endian_host = *(uint8_t*)&probe == 1;
+    if ((scale < 0) != little_endian_host) {
+        for (float &value : values) {
+            uint8_t* bytes = (uint8_t*)&value;
+            std::reverse(bytes, bytes + 4);
+        }
+    }
+    // Vec3f may be padded (USE_SIMD_VEC), so pixels are built from the packed floats
+    std::vector<Vec3f> pixels((size_t)width * height);
+    for (size_t i = 0; i < pixels.size(); i++) pixels[i] = Vec3f(&values[3 * i]);
+    return pixels;
+}
+
+struct ImageError {
+    double rmse;
+    double relmse; // Squared error relative to the squared reference, so dark regions weigh as much as bright ones
+};
+
+ImageError image_error(const std::vector<Vec3f> &image, const std::vector<Vec3f> &reference) {
+    double squared = 0, relative = 0;
+    for (size_t i = 0; i < image.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            double difference = image[i][j] - reference[i][j];
+            squared += difference * difference;
+            relative += difference * difference / (reference[i][j] * reference[i][j] + 1e-2);
+        }
+    }
+    size_t count = 3 * std::max<size_t>(image.size(), 1);
+    return ImageError{sqrt(squared / count), relative / count};
+}
+
+// Path as a single shell word, in single quotes
+std::string shell_quote(const std::string &path) {
+    std::string quoted = "'";
+    for (char c : path) quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    return quoted + "'";
+}
+
+// Runs the renderer with args, its output going to log. Returns the wall-clock seconds it took.
+// The args are split by the shell, so paths in them must already be quoted.
+double run_renderer(const Suite &suite, const std::string &args, const std::string &log) {
+    std::string command = shell_quote(suite.renderer) + " --resolution " + std::to_string(suite.width) + "," + std::to_string(suite.height) + " " + args + " > " + shell_quote(log) + " 2>&1";
+    auto start = std::chrono::steady_clock::now();
+    int status = std::system(command.c_str());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (status != 0) throw std::runtime_error("renderer failed, see " + log);
+    return seconds;
+}
+
+void copy_file(const std::string &from, const std::string &to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    out << in.rdbuf();
+    if (!in || !out) throw std::runtime_error("cannot copy " + from + " to " + to);
+}
+
+bool file_exists(const std::string &path) {
+    return std::ifstream(path).good();
+}
+
+struct CurvePoint {
+    int spp;
+    double seconds;
+    ImageError error;
+};
+
+// RMSE reached in seconds, interpolated linearly in log time and log error between the measured
+// points that no faster point beats; negative when no measured render was that fast
+double error_at_time(std::vector<CurvePoint> points, double seconds) {
+    std::sort(points.begin(), points.end(), [](const CurvePoint &a, const CurvePoint &b) { return a.seconds < b.seconds; });
+    std::vector<CurvePoint> curve;
+    for (const CurvePoint &point : points) {
+        if (curve.empty() || point.error.rmse < curve.back().error.rmse) curve.push_back(point);
+    }
+    if (curve.empty() || seconds < curve.front().seconds) return -1;
+    for (size_t i = 1; i < curve.size(); i++) {
+        if (seconds > curve[i].seconds) continue;
+        const CurvePoint &a = curve[i - 1], &b = curve[i];
+        if (b.seconds <= a.seconds || a.error.rmse <= 0 || b.error.rmse <= 0) return b.error.rmse;
+        double f = log(seconds / a.seconds) / log(b.seconds / a.seconds);
+        return exp((1 - f) * log(a.error.rmse) + f * log(b.error.rmse));
+    }
+    return curve.back().error.rmse;
+}
+
+struct HarnessOptions {
+    std::string suite_file = "convergence.suite";
+    std::string directory = "convergence";
+    std::string filter;
+    bool update_golden = false;
+    bool update_references = false;
+};
+
+void print_harness_usage(char const * program) {
+    cout << "Usage: " << program << " [options]" << endl;
+    cout << "  --suite FILE                    suite to run (default convergence.suite)" << endl;
+    cout << "  --dir DIR                       directory of the references, golden images, renders and" << endl;
+    cout << "                                  curves.csv (default convergence)" << endl;
+    cout << "  --filter TEXT                   only run scene/config pairs whose name contains TEXT" << endl;
+    cout << "  --update-golden                 store the golden sample count renders as the new golden images" << endl;
+    cout << "  --update-references             render the references again even when they exist" << endl;
+}
+
+int main(int argc, char **argv) {
+    HarnessOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--suite" && !value.empty()) {
+            options.suite_file = value;
+            i++;
+        } else if (arg == "--dir" && !value.empty()) {
+            options.directory = value;
+            i++;
+        } else if (arg == "--filter" && !value.empty()) {
+            options.filter = value;
+            i++;
+        } else if (arg == "--update-golden") {
+            options.update_golden = true;
+        } else if (arg == "--update-references") {
+            options.update_references = true;
+        } else {
+            print_harness_usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    Suite suite;
+    try {
+        suite = read_suite(options.suite_file);
+    } catch (const std::exception &e) {
+        cout << "Failed to load suite: " << e.what() << endl;
+        return 1;
+    }
+    std::vector<int> spps = suite.spps;
+    if (std::find(spps.begin(), spps.end(), suite.golden_spp) == spps.end()) spps.push_back(suite.golden_spp);
+    std::sort(spps.begin(), spps.end());
+    std::string directory = options.directory + "/";
+    try {
+        for (const char* sub : {"references", "golden", "renders"}) std::filesystem::create_directories(directory + sub);
+    } catch (const std::exception &e) {
+        cout << "Failed to create directories: " << e.what() << endl;
+        return 1;
+    }
+
+    std::ofstream curves(directory + "curves.csv");
+    curves << "scene,config,spp,seconds,rmse,relmse" << endl;
+    int failures = 0;
+    for (const SuiteEntry &scene : suite.scenes) {
+        std::vector<const SuiteEntry*> configs;
+        for (const SuiteEntry &config : suite.configs) {
+            if ((scene.name + "/" + config.name).find(options.filter) != std::string::npos) configs.push_back(&config);
+        }
+        if (configs.empty()) continue;
+
+        std::vector<Vec3f> reference;
+        std::string reference_file = directory + "references/" + scene.name + ".pfm";
+        try {
+            if (options.update_references || !file_exists(reference_file)) {
+                cout << "Rendering reference " << reference_file << endl;
+                double seconds = run_renderer(suite, "--seed " + std::to_string(suite.seed + 1) + " " + scene.args + " " + suite.reference_args +
+                                              " --output " + shell_quote(reference_file), directory + "renders/" + scene.name + "_reference.log");
+                cout << "Reference done in " << seconds << "s" << endl;
+            }
+            reference = read_pfm(reference_file, suite.width, suite.height);
+        } catch (const std::exception &e) {
+            cout << "FAIL " << scene.name << ": " << e.what() << endl;
+            failures++;
+            continue;
+        }
+
+        std::vector<std::vector<CurvePoint>> scene_curves;
+        for (const SuiteEntry* config : configs) {
+            std::string name = scene.name + "_" + config->name;
+            std::vector<CurvePoint> curve;
+            try {
+                for (int spp : spps) {
+                    std::string render_file = directory + "renders/" + name + "_spp" + std::to_string(spp) + ".pfm";
+                    double seconds = run_renderer(suite, "--seed " + std::to_string(suite.seed) + " " + scene.args + " " + config->args +
+                                                  " --spp " + std::to_string(spp) + " --output " + shell_quote(render_file),
+                                                  directory + "renders/" + name + "_spp" + std::to_string(spp) + ".log");
+                    std::vector<Vec3f> image = read_pfm(render_file, suite.width, suite.height);
+                    ImageError error = image_error(image, reference);
+                    curve.push_back(CurvePoint{spp, seconds, error});
+                    curves << scene.name << "," << config->name << "," << spp << "," << seconds << "," << error.rmse << "," << error.relmse << endl;
+                    cout << std::left << std::setw(32) << scene.name + "/" + config->name << std::right << std::setw(6) << spp << " spp "
+                         << std::setw(10) << std::fixed << std::setprecision(2) << seconds << "s  rmse " << std::scientific
+                         << std::setprecision(3) << error.rmse << "  relmse " << error.relmse << std::defaultfloat << endl;
+                    if (spp != suite.golden_spp) continue;
+
+                    // Regression checks against the golden image and the time budget
+                    std::string golden_file = directory + "golden/" + name + ".pfm";
+                    if (options.update_golden) {
+                        copy_file(render_file, golden_file);
+                        cout << "Golden image " << golden_file << " updated" << endl;
+                    } else if (!file_exists(golden_file)) {
+                        cout << "No golden image " << golden_file << ", run with --update-golden to create it" << endl;
+                    } else {
+                        double golden_rmse = image_error(image, read_pfm(golden_file, suite.width, suite.height)).rmse;
+                        if (golden_rmse > suite.golden_tolerance) {
+                            cout << "FAIL " << name << ": RMSE " << golden_rmse << " against the golden image exceeds " << suite.golden_tolerance << endl;
+                            failures++;
+                        }
+                    }
+                    if (config->time_budget > 0 && seconds > config->time_budget) {
+                        cout << "FAIL " << name << ": " << seconds << "s exceeds the time budget of " << config->time_budget << "s" << endl;
+                        failures++;
+                    }
+                }
+            } catch (const std::exception &e) {
+                cout << "FAIL " << name << ": " << e.what() << endl;
+                failures++;
+            }
+            scene_curves.push_back(curve);
+        }
+
+        // Equal-time comparison: the error each configuration reaches in the same wall-clock time
+        std::vector<float> times = suite.equal_times;
+        if (times.empty()) {
+            double horizon = __DBL_MAX__;
+            for (const std::vector<CurvePoint> &curve : scene_curves) {
+                double longest = 0;
+                for (const CurvePoint &point : curve) longest = std::max(longest, point.seconds);
+                horizon = std::min(horizon, longest);
+            }
+            if (horizon > 0) times.push_back(horizon);
+        }
+        for (float seconds : times) {
+            cout << "Equal time " << scene.name << " at " << seconds << "s:";
+            for (size_t c = 0; c < configs.size(); c++) {
+                double rmse = error_at_time(scene_curves[c], seconds);
+                cout << "  " << configs[c]->name << " ";
+                if (rmse < 0) {
+                    cout << "too slow";
+                } else {
+                    cout << std::scientific << std::setprecision(3) << rmse << std::defaultfloat;
+                }
+            }
+            cout << endl;
+        }
+    }
+
+    cout << (failures == 0 ? "All checks passed" : std::to_string(failures) + " checks failed") << ", curves written to " << directory << "curves.csv" << endl;
+    return failures == 0 ? 0 : 1;
+}
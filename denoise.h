@@ -0,0 +1,171 @@
+#pragma once
+
+#include "common.h"
+#include "scene.h"
+#include "raytracer.h"
+#include "camera.h"
+
+const int FEATURE_SPP = 4;
+
+// Auxiliary buffers (AOVs) of a pixel, averaged over its feature samples. They describe the first
+// diffuse surface seen through any glass, which is what the denoiser has to keep edges of.
+struct PixelFeatures {
+    Vec3f albedo;
+    Vec3f normal;
+    float depth;       // Distance along the camera ray to the first hit, glass included
+    int surface_id;    // Surface index of the first diffuse hit of the first sample, -1 for none
+};
+
+struct FeatureSample {
+    Vec3f albedo{0.0f, 0.0f, 0.0f};
+    Vec3f normal{0.0f, 0.0f, 0.0f};
+    float depth = 0;
+    int surface_id = -1;
+};
+
+// Follows the refracted camera path through glass up to its first diffuse or emitting hit
+FeatureSample trace_features(Vec3f ray_origin, Vec3f ray_direction) {
+    FeatureSample sample;
+    for (int depth = 0; depth < 8; depth++) {
+        count_stat(CAMERA_RAYS);
+        Hit hit = closest_hit(ray_origin, ray_direction, scene.scene_elements, scene.mesh_geometry);
+        if (!hit.found) break;
+
+        Vec3f hit_point = ray_origin + hit.t * ray_direction;
+        if (depth == 0) sample.depth = hit.t;
+        if (is_emitter(hit)) {
+            sample.albedo = Vec3f{1.0f, 1.0f, 1.0f};
+            sample.normal = surface(hit).normal;
+            sample.surface_id = hit.surface_index;
+            break;
+        }
+        const Surface &s = surface(hit);
+        Vec3f normal = hit_normal(hit, hit_point);
+        if (s.type != CAUSTIC) {
+            sample.albedo = s.albedo;
+            sample.normal = diffuse_normal(hit, normal, ray_direction);
+            sample.surface_id = hit.surface_index;
+            break;
+        }
+
+        if (dot(normal, ray_direction) > 0) { // Hit from behind
+            ray_origin = offset_ray_origin(hit_point, normal);
+            ray_direction = photon_refract(-ray_direction, -normal, false);
+        } else { // Hit from front
+            ray_origin = offset_ray_origin(hit_point, -normal);
+            ray_direction = photon_refract(-ray_direction, normal);
+        }
+        if (!(length2(ray_direction) > 0)) break; // Total internal reflection
+    }
+    return sample;
+}
+
+// Features of every pixel of region, indexed like the framebuffer. The samples draw from their own
+// random streams so that tracing them does not change the rendered image.
+std::vector<PixelFeatures> render_features(ImageRegion region) {
+    std::vector<PixelFeatures> features(scene.image_width * scene.image_height, PixelFeatures{});
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (int y = region.y0; y < region.y1; y++) {
+        for (int x = region.x0; x < region.x1; x++) {
+            seed_random(~random_seed, (uint64_t)y * scene.image_width + x + 1);
+            PixelFeatures &pixel = features[y * scene.image_width + x];
+            pixel = PixelFeatures{Vec3f{0.0f, 0.0f, 0.0f}, Vec3f{0.0f, 0.0f, 0.0f}, 0, -1};
+            for (int i = 0; i < FEATURE_SPP; i++) {
+                float u = ((float)x + (i == 0 ? 0.5f : random_uniform()))/scene.image_width;
+                float v = ((float)y + (i == 0 ? 0.5f : random_uniform()))/scene.image_height;
+                FeatureSample sample = trace_features(scene.camera_position, camera_ray_direction(u, v));
+                pixel.albedo += sample.albedo / (float)FEATURE_SPP;
+                pixel.normal += sample.normal / (float)FEATURE_SPP;
+                pixel.depth += sample.depth / FEATURE_SPP;
+                if (i == 0) pixel.surface_id = sample.surface_id;
+            }
+        }
+    }
+    return features;
+}
+
+// Edge-stopping sensitivities of the filter; smaller values keep more edges
+const float DENOISE_SIGMA_COLOR = 1.0f;
+const float DENOISE_SIGMA_NORMAL = 0.3f;
+const float DENOISE_SIGMA_DEPTH = 0.05f;
+const float DENOISE_SIGMA_ALBEDO = 0.1f;
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) over region of pixels. Radiance is
+// divided by albedo before filtering and multiplied back after, so that only the noisy lighting is
+// smoothed. Each iteration applies the 5x5 B3 spline kernel with holes 2^iteration pixels apart,
+// weighted down across differences in lighting, normal, depth, albedo and surface. Lighting
+// differences are relative to the mean brightness around the pixel, so that a dark outlier does
+// not shut out its own neighbors.
+void denoise_atrous(std::vector<Vec3f> &pixels, const std::vector<PixelFeatures> &features, ImageRegion region, int iterations) {
+    const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    int width = scene.image_width;
+
+    std::vector<Vec3f> irradiance(pixels.size()), filtered(pixels.size());
+    for (int y = region.y0; y < region.y1; y++) {
+        for (int x = region.x0; x < region.x1; x++) {
+            int i = y * width + x;
+            irradiance[i] = pixels[i] / max(features[i].albedo, Vec3f{0.01f, 0.01f, 0.01f});
+        }
+    }
+
+    const Vec3f luminance_weights{0.2126f, 0.7152f, 0.0722f};
+    std::vector<float> local_luminance(pixels.size());
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        int step = 1 << iteration;
+        #pragma omp parallel for
+        for (int y = region.y0; y < region.y1; y++) {
+            for (int x = region.x0; x < region.x1; x++) {
+                float sum = 0;
+                for (int j = -1; j <= 1; j++) {
+                    for (int k = -1; k <= 1; k++) {
+                        int q = std::clamp(y + j, region.y0, region.y1 - 1) * width + std::clamp(x + k, region.x0, region.x1 - 1);
+                        sum += dot(irradiance[q], luminance_weights);
+                    }
+                }
+                local_luminance[y * width + x] = sum / 9;
+            }
+        }
+
+        // Later iterations see smoother input, so lighting differences count for more
+        float inv_sigma_color = 1.0f / (DENOISE_SIGMA_COLOR * DENOISE_SIGMA_COLOR) * step;
+        #pragma omp parallel for schedule(dynamic, 4)
+        for (int y = region.y0; y < region.y1; y++) {
+            for (int x = region.x0; x < region.x1; x++) {
+                int p = y * width + x;
+                const PixelFeatures &fp = features[p];
+                Vec3f cp = irradiance[p];
+                float lp = local_luminance[p];
+                Vec3f sum{0.0f, 0.0f, 0.0f};
+                float weight_sum = 0;
+                for (int j = -2; j <= 2; j++) {
+                    int qy = std::clamp(y + j * step, region.y0, region.y1 - 1);
+                    for (int k = -2; k <= 2; k++) {
+                        int qx = std::clamp(x + k * step, region.x0, region.x1 - 1);
+                        int q = qy * width + qx;
+                        const PixelFeatures &fq = features[q];
+                        Vec3f cq = irradiance[q];
+                        float color_distance = length2(cp - cq) / (lp * lp + 1e-4f);
+                        float depth_distance = fabsf(fp.depth - fq.depth) / (DENOISE_SIGMA_DEPTH * step * (fp.depth + 1e-3f));
+                        float weight = kernel[j + 2] * kernel[k + 2]
+                            * expf(-color_distance * inv_sigma_color
+                                   - length2(fp.normal - fq.normal) / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL)
+                                   - depth_distance
+                                   - length2(fp.albedo - fq.albedo) / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO))
+                            * (fp.surface_id == fq.surface_id);
+                        sum += weight * cq;
+                        weight_sum += weight;
+                    }
+                }
+                filtered[p] = weight_sum > 0 ? sum / weight_sum : cp;
+            }
+        }
+        std::swap(irradiance, filtered);
+    }
+
+    for (int y = region.y0; y < region.y1; y++) {
+        for (int x = region.x0; x < region.x1; x++) {
+            int i = y * width + x;
+            pixels[i] = irradiance[i] * max(features[i].albedo, Vec3f{0.01f, 0.01f, 0.01f});
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+#include "common.h"
+#include "stats.h"
+
+// Time stamp counter where the CPU has one, otherwise steady clock ticks
+inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Result of the latest photon gather into one map on this thread
+struct GatherRecord {
+    bool gathered = false;
+    float radius = 0; // Distance to the farthest of the photons found
+    int found = 0;
+};
+
+thread_local GatherRecord last_diffuse_gather;
+thread_local GatherRecord last_caustic_gather;
+
+inline void record_gather(GatherRecord &record, float radius, int found) {
+    record = GatherRecord{true, radius, found};
+}
+
+// Cost of one pixel summed over the passes that rendered it. Photons are gathered once per pass,
+// at the first diffuse hit of the pass's first sample.
+struct PixelDiagnostics {
+    double cycles = 0;
+    uint64_t kd_nodes_visited = 0;
+    uint64_t caustic_hits = 0;
+    uint32_t samples = 0;
+    uint32_t diffuse_gathers = 0;
+    uint32_t caustic_gathers = 0;
+    float diffuse_radius = 0;  // Sums over the gathers
+    float caustic_radius = 0;
+    float diffuse_found = 0;
+    float caustic_found = 0;
+};
+
+// Frame-sized when --diagnostics is set, empty otherwise
+std::vector<PixelDiagnostics> pixel_diagnostics;
+
+// Counters of the rendering thread when a pixel starts
+struct PixelProbe {
+    uint64_t cycles;
+    uint64_t kd_nodes_visited;
+    uint64_t caustic_hits;
+};
+
+inline PixelProbe start_pixel_probe() {
+    last_diffuse_gather = GatherRecord();
+    last_caustic_gather = GatherRecord();
+    return PixelProbe{read_cycle_counter(), thread_stats.counts[KD_NODES_VISITED], thread_stats.counts[CAUSTIC_HITS]};
+}
+
+inline void finish_pixel_probe(const PixelProbe &probe, int spp, PixelDiagnostics &pixel) {
+    pixel.cycles += read_cycle_counter() - probe.cycles;
+    pixel.kd_nodes_visited += thread_stats.counts[KD_NODES_VISITED] - probe.kd_nodes_visited;
+    pixel.caustic_hits += thread_stats.counts[CAUSTIC_HITS] - probe.caustic_hits;
+    pixel.samples += spp;
+    if (last_diffuse_gather.gathered) {
+        pixel.diffuse_gathers++;
+        pixel.diffuse_radius += last_diffuse_gather.radius;
+        pixel.diffuse_found += last_diffuse_gather.found;
+    }
+    if (last_caustic_gather.gathered) {
+        pixel.caustic_gathers++;
+        pixel.caustic_radius += last_caustic_gather.radius;
+        pixel.caustic_found += last_caustic_gather.found;
+    }
+}
+
+// Black, red, yellow, white ramp over [0, 1]
+Vec3f heat_color(float t) {
+    t = std::max(0.0f, std::min(1.0f, t));
+    return Vec3f{std::min(1.0f, 3 * t), std::max(0.0f, std::min(1.0f, 3 * t - 1)), std::max(0.0f, 3 * t - 2)};
+}
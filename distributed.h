@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "camera.h"
+#include "server.h"
+
+const int DISTRIBUTED_TILE_SIZE = 64;
+
+// A copy of this program answering --serve render jobs through a pair of pipes. Pipes stand in for
+// the network transport a multi-machine setup would use; the job protocol is the same.
+class WorkerProcess {
+    public:
+        WorkerProcess(const std::vector<std::string> &args);
+        ~WorkerProcess();
+        WorkerProcess(const WorkerProcess &) = delete;
+        WorkerProcess &operator=(const WorkerProcess &) = delete;
+        void render(const std::string &job, ImageRegion tile, std::vector<Vec3f> &pixels);
+    private:
+        FILE* jobs = nullptr;
+        FILE* replies = nullptr;
+#ifndef _WIN32
+        pid_t pid = -1;
+#endif
+};
+
+#ifdef _WIN32
+WorkerProcess::WorkerProcess(const std::vector<std::string> &args) {
+    throw std::runtime_error("worker processes are not available on this platform");
+}
+
+WorkerProcess::~WorkerProcess() {}
+#else
+WorkerProcess::WorkerProcess(const std::vector<std::string> &args) {
+    int to_worker[2], from_worker[2];
+    if (pipe(to_worker) != 0) throw std::runtime_error("cannot create worker pipe");
+    if (pipe(from_worker) != 0) {
+        close(to_worker[0]);
+        close(to_worker[1]);
+        throw std::runtime_error("cannot create worker pipe");
+    }
+    // Later workers must not inherit this worker's pipe ends, or it would never see its input close
+    for (int fd : {to_worker[0], to_worker[1], from_worker[0], from_worker[1]}) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN); // A crashed worker is reported as an error instead of killing the coordinator
+
+    std::vector<char*> argv;
+    for (const std::string &arg : args) argv.push_back((char*)arg.c_str());
+    argv.push_back(nullptr);
+
+    pid = fork();
+    if (pid == 0) {
+        dup2(to_worker[0], STDIN_FILENO);
+        dup2(from_worker[1], STDOUT_FILENO);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(to_worker[0]);
+    close(from_worker[1]);
+    if (pid < 0) {
+        close(to_worker[1]);
+        close(from_worker[0]);
+        throw std::runtime_error("cannot start worker process");
+    }
+    jobs = fdopen(to_worker[1], "w");
+    replies = fdopen(from_worker[0], "r");
+}
+
+WorkerProcess::~WorkerProcess() {
+    fputs("quit\n", jobs);
+    fclose(jobs);
+    fclose(replies);
+    waitpid(pid, nullptr, 0);
+}
+#endif
+
+// Sends one render job for tile and reads back its pixels, row-major with tile.width() pixels per row
+void WorkerProcess::render(const std::string &job, ImageRegion tile, std::vector<Vec3f> &pixels) {
+    fprintf(jobs, "%s region=%d,%d,%d,%d\n", job.c_str(), tile.x0, tile.y0, tile.x1, tile.y1);
+    fflush(jobs);
+
+    std::string reply;
+    if (!read_job_line(replies, reply)) throw std::runtime_error("worker exited");
+    ImageRegion replied;
+    if (sscanf(reply.c_str(), "ok %d %d %d %d", &replied.x0, &replied.y0, &replied.x1, &replied.y1) != 4) {
+        throw std::runtime_error("worker replied '" + reply + "'");
+    }
+    if (replied.x0 != tile.x0 || replied.y0 != tile.y0 || replied.x1 != tile.x1 || replied.y1 != tile.y1) {
+        throw std::runtime_error("worker rendered the wrong region");
+    }
+    pixels.resize(tile.width() * tile.height());
+    if (sizeof(Vec3f) == 3 * sizeof(float)) {
+        if (fread(pixels.data(), sizeof(Vec3f), pixels.size(), replies) != pixels.size()) throw std::runtime_error("worker exited mid-tile");
+    } else {
+        // The protocol sends three floats per pixel, padded Vec3f (USE_SIMD_VEC) is unpacked
+        std::vector<float> packed(3 * pixels.size());
+        if (fread(packed.data(), 3 * sizeof(float), pixels.size(), replies) != pixels.size()) throw std::runtime_error("worker exited mid-tile");
+        for (size_t i = 0; i < pixels.size(); i++) pixels[i] = Vec3f{packed[3 * i], packed[3 * i + 1], packed[3 * i + 2]};
+    }
+}
+
+// Renders region of the image on the workers, each pulling the next tile as it finishes one, and
+// hands every finished tile to tile_done(tile, pixels) one at a time. Pixels are seeded from their
+// position and every worker holds the same photon maps, so the merged image does not depend on the
+// number of workers or on which worker rendered which tile.
+template<typename TileDone>
+void render_tiles(std::vector<std::unique_ptr<WorkerProcess>> &workers, const std::string &job, ImageRegion region, TileDone tile_done) {
+    std::vector<ImageRegion> tiles;
+    for (int y = region.y0; y < region.y1; y += DISTRIBUTED_TILE_SIZE) {
+        for (int x = region.x0; x < region.x1; x += DISTRIBUTED_TILE_SIZE) {
+            tiles.push_back(ImageRegion{x, y, std::min(x + DISTRIBUTED_TILE_SIZE, region.x1), std::min(y + DISTRIBUTED_TILE_SIZE, region.y1)});
+        }
+    }
+
+    std::atomic<size_t> next_tile{0};
+    std::mutex mutex;
+    std::string error;
+    size_t tiles_done = 0;
+    std::vector<std::thread> threads;
+    for (std::unique_ptr<WorkerProcess> &worker : workers) {
+        threads.emplace_back([&, worker = worker.get()]() {
+            std::vector<Vec3f> tile_pixels;
+            try {
+                for (size_t t = next_tile++; t < tiles.size(); t = next_tile++) {
+                    const ImageRegion &tile = tiles[t];
+                    worker->render(job, tile, tile_pixels);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    tile_done(tile, tile_pixels.data());
+                    cout << "Tile " << ++tiles_done << "/" << tiles.size() << " complete" << endl;
+                }
+            } catch (const std::exception &e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) error = e.what();
+                next_tile = tiles.size();
+            }
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+    if (!error.empty()) throw std::runtime_error(error);
+}
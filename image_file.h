@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+
+#include "common.h"
+#include "camera.h"
+
+enum ImageFormat {
+    PNG_FORMAT,
+    PPM_FORMAT,
+    PFM_FORMAT,
+    EXR_FORMAT
+};
+
+ImageFormat image_format(const std::string &path) {
+    std::string extension = path.substr(path.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "png") return PNG_FORMAT;
+    if (extension == "ppm") return PPM_FORMAT;
+    if (extension == "pfm") return PFM_FORMAT;
+    if (extension == "exr") return EXR_FORMAT;
+    throw std::runtime_error(path + ": unsupported image format, expected .png, .ppm, .pfm or .exr");
+}
+
+// Image file with uncompressed fixed-size scanlines, created at its final size so that finished
+// blocks of pixels can be written in place in any order. Only the pixels in flight are held in
+// memory, and rows rendered before a crash are already on disk. PPM is tone mapped to 8 bits,
+// PFM and EXR store linear float radiance; rows that are never written stay black.
+class ScanlineImageFile {
+    public:
+        ScanlineImageFile(const std::string &path, int given_width, int given_height, ImageFormat given_format);
+        void write_block(ImageRegion block, const Vec3f* pixels);
+    private:
+        std::fstream file;
+        std::string path;
+        int width;
+        int height;
+        ImageFormat format;
+        uint64_t data_offset = 0;
+        uint64_t scanline_size = 0;
+        uint64_t scanline_offset(int y);
+        void write_exr_header();
+};
+
+bool little_endian_host() {
+    uint16_t probe = 1;
+    return *(uint8_t*)&probe == 1;
+}
+
+ScanlineImageFile::ScanlineImageFile(const std::string &given_path, int given_width, int given_height, ImageFormat given_format) {
+    path = given_path;
+    width = given_width;
+    height = given_height;
+    format = given_format;
+    if (format == PNG_FORMAT) throw std::runtime_error(path + ": PNG is not written by scanlines");
+    if (format == EXR_FORMAT && !little_endian_host()) throw std::runtime_error(path + ": EXR output needs a little endian host");
+
+    file.open(path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!file) throw std::runtime_error("cannot create " + path);
+    if (format == EXR_FORMAT) {
+        write_exr_header();
+    } else {
+        // PFM marks little endian data with a negative scale
+        std::string header = format == PPM_FORMAT ? "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n"
+            : "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n" + (little_endian_host() ? "-1.0\n" : "1.0\n");
+        file.write(header.data(), header.size());
+        data_offset = header.size();
+        scanline_size = (uint64_t)width * (format == PPM_FORMAT ? 3 : 3 * sizeof(float));
+    }
+
+    uint64_t size = scanline_offset(height - 1) + scanline_size;
+    file.seekp(size - 1);
+    file.put(0);
+    if (!file) throw std::runtime_error("cannot allocate " + path);
+}
+
+// Scanline y (0 is the top row) starts at this offset. PFM stores rows bottom to top, EXR chunks
+// start with their row number and data size.
+uint64_t ScanlineImageFile::scanline_offset(int y) {
+    if (format == PFM_FORMAT) return data_offset + (uint64_t)(height - 1 - y) * scanline_size;
+    if (format == EXR_FORMAT) return data_offset + (uint64_t)y * (8 + scanline_size);
+    return data_offset + (uint64_t)y * scanline_size;
+}
+
+// Minimal single part scanline EXR: B, G, R float channels without compression, one row per chunk
+void ScanlineImageFile::write_exr_header() {
+    std::string header("\x76\x2f\x31\x01\x02\x00\x00\x00", 8);
+    auto attribute = [&](const char* name, const char* type, const void* value, int32_t size) {
+        header.append(name, strlen(name) + 1);
+        header.append(type, strlen(type) + 1);
+        header.append((const char*)&size, 4);
+        header.append((const char*)value, size);
+    };
+    std::string channels;
+    for (const char* name : {"B", "G", "R"}) {
+        int32_t channel[4] = {2, 0, 1, 1}; // FLOAT, not linear plus reserved bytes, x and y sampling
+        channels.append(name, 2);
+        channels.append((const char*)channel, sizeof(channel));
+    }
+    channels.push_back('\0');
+    int32_t window[4] = {0, 0, width - 1, height - 1};
+    uint8_t no_compression = 0, increasing_y = 0;
+    float one = 1, center[2] = {0, 0};
+    attribute("channels", "chlist", channels.data(), channels.size());
+    attribute("compression", "compression", &no_compression, 1);
+    attribute("dataWindow", "box2i", window, sizeof(window));
+    attribute("displayWindow", "box2i", window, sizeof(window));
+    attribute("lineOrder", "lineOrder", &increasing_y, 1);
+    attribute("pixelAspectRatio", "float", &one, 4);
+    attribute("screenWindowCenter", "v2f", center, sizeof(center));
+    attribute("screenWindowWidth", "float", &one, 4);
+    header.push_back('\0');
+
+    scanline_size = (uint64_t)width * 3 * sizeof(float);
+    data_offset = header.size() + (uint64_t)height * sizeof(uint64_t);
+    std::vector<uint64_t> offsets(height);
+    for (int y = 0; y < height; y++) offsets[y] = scanline_offset(y);
+    file.write(header.data(), header.size());
+    file.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+
+    // Chunk headers of every row, so rows that are never rendered still read back as black
+    for (int y = 0; y < height; y++) {
+        int32_t chunk[2] = {y, (int32_t)scanline_size};
+        file.seekp(scanline_offset(y));
+        file.write((const char*)chunk, sizeof(chunk));
+    }
+}
+
+// pixels holds block row-major, block.width() pixels per row
+void ScanlineImageFile::write_block(ImageRegion block, const Vec3f* pixels) {
+    std::vector<char> bytes;
+    for (int y = block.y0; y < block.y1; y++) {
+        const Vec3f* row = pixels + (size_t)(y - block.y0) * block.width();
+        if (format == PPM_FORMAT) {
+            bytes.resize(3 * block.width());
+            for (int x = 0; x < block.width(); x++) {
+                Vec3f pixel = tone_map_Aces(row[x]);
+                for (int j = 0; j < 3; j++) {
+                    bytes[3 * x + j] = (uint8_t)(255.0f * std::max(0.0f, std::min(1.0f, pixel[j])));
+                }
+            }
+            file.seekp(scanline_offset(y) + 3 * (uint64_t)block.x0);
+            file.write(bytes.data(), bytes.size());
+        } else if (format == PFM_FORMAT) {
+            file.seekp(scanline_offset(y) + 3 * sizeof(float) * (uint64_t)block.x0);
+            if (sizeof(Vec3f) == 3 * sizeof(float)) {
+                file.write((const char*)row, block.width() * sizeof(Vec3f));
+            } else {
+                // Padded Vec3f (USE_SIMD_VEC) is packed to three floats per pixel
+                bytes.resize(block.width() * 3 * sizeof(float));
+                for (int x = 0; x < block.width(); x++) memcpy(&bytes[x * 3 * sizeof(float)], &row[x], 3 * sizeof(float));
+                file.write(bytes.data(), bytes.size());
+            }
+        } else {
+            // EXR rows are planar, one run of floats per channel in B, G, R order
+            bytes.resize(block.width() * sizeof(float));
+            for (int channel = 0; channel < 3; channel++) {
+                for (int x = 0; x < block.width(); x++) {
+                    memcpy(&bytes[x * sizeof(float)], &row[x][2 - channel], sizeof(float));
+                }
+                file.seekp(scanline_offset(y) + 8 + (uint64_t)width * sizeof(float) * channel + sizeof(float) * (uint64_t)block.x0);
+                file.write(bytes.data(), bytes.size());
+            }
+        }
+    }
+    file.flush();
+    if (!file) throw std::runtime_error("failed writing " + path);
+}
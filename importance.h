@@ -0,0 +1,171 @@
+#pragma once
+
+#include "common.h"
+#include "scene.h"
+#include "raytracer.h"
+#include "kdtree.h"
+#include "sampling.h"
+
+// Visual importance over the lights' emission domains. Importons are traced from the camera to
+// their first diffuse hit and indexed in their own kd-tree; pilot photons then score every
+// (light, light patch, hemisphere cell) triple by the importon density where they would deposit power.
+class ImportanceMap {
+    public:
+        int patches = 1;
+        int resolution = 1;
+        float uniform_fraction = 0.1f;
+        std::vector<Photon> importons;
+        KDTree importon_kd;
+        Distribution1D distribution;
+        ImportanceMap();
+        ImportanceMap(int given_patches, int given_resolution);
+        void trace_importons(int num_importons);
+        void build(int pilots_per_cell, int k);
+        // Returns the light the photon leaves from
+        int sample(Vec3f &position, Vec3f &direction, float &weight);
+    private:
+        int cells_per_light();
+        float importance(Vec3f x, int surface_index, int k);
+        float pilot(Vec3f ray_origin, Vec3f ray_direction, int k);
+        int cell_sample(int cell, Vec3f &position, Vec3f &direction);
+};
+
+ImportanceMap::ImportanceMap() {}
+
+ImportanceMap::ImportanceMap(int given_patches, int given_resolution) {
+    patches = given_patches;
+    resolution = given_resolution;
+}
+
+void ImportanceMap::trace_importons(int num_importons) {
+    importons.clear();
+    for (int n = 0; n < num_importons; n++) {
+        Vec3f ray_origin = scene.camera_position;
+        Vec3f ray_direction = camera_ray_direction(random_uniform(), random_uniform());
+
+        for (int depth = 0; depth < 16; depth++) {
+            count_stat(CAMERA_RAYS);
+            Hit hit = closest_hit(ray_origin, ray_direction, scene.scene_elements, scene.mesh_geometry);
+            if (!hit.found || is_emitter(hit)) break;
+
+            Vec3f hit_point = ray_origin + hit.t * ray_direction;
+            if (surface(hit).type != CAUSTIC) {
+                float w = 1.0f / num_importons;
+                importons.push_back(Photon{hit_point, -ray_direction, Vec3f{w, w, w}, hit.surface_index});
+                break;
+            }
+
+            Vec3f normal = hit_normal(hit, hit_point);
+            if (dot(normal, ray_direction) > 0) { // Hit from behind
+                ray_origin = offset_ray_origin(hit_point, normal);
+                ray_direction = photon_refract(-ray_direction, -normal, false);
+            } else { // Hit from front
+                ray_origin = offset_ray_origin(hit_point, -normal);
+                ray_direction = photon_refract(-ray_direction, normal);
+            }
+        }
+    }
+
+    importon_kd = KDTree(&importons);
+    if (!importons.empty()) importon_kd.balance();
+}
+
+// Importon density estimate at x, the same kNN estimate the renderer uses for radiance
+float ImportanceMap::importance(Vec3f x, int surface_index, int k) {
+    NNQ nnq;
+    count_stat(PHOTON_GATHERS);
+    importon_kd.locate_photons(x, k, surface_index, nnq);
+    if (nnq.empty()) return 0;
+
+    float r = std::max(nnq.top().first, 1e-4f);
+    float total = 0;
+    while (!nnq.empty()) {
+        total += importons[nnq.top().second].power.x;
+        nnq.pop();
+    }
+    return total / (PI * r * r);
+}
+
+// Importance gathered along a short photon path, weighted by the expected surviving power
+float ImportanceMap::pilot(Vec3f ray_origin, Vec3f ray_direction, int k) {
+    float throughput = 1;
+    float total = 0;
+    for (int depth = 0; depth < 4; depth++) {
+        count_stat(PHOTON_RAYS);
+        Hit hit = closest_hit(ray_origin, ray_direction, scene.scene_elements, scene.mesh_geometry);
+        if (!hit.found) break;
+
+        Vec3f hit_point = ray_origin + hit.t * ray_direction;
+        Vec3f normal = hit_normal(hit, hit_point);
+        const Surface &s = surface(hit);
+        if (s.type == CAUSTIC) {
+            if (dot(normal, ray_direction) > 0) { // Hit from behind
+                ray_origin = offset_ray_origin(hit_point, normal);
+                ray_direction = photon_refract(-ray_direction, -normal, false);
+            } else { // Hit from front
+                ray_origin = offset_ray_origin(hit_point, -normal);
+                ray_direction = photon_refract(-ray_direction, normal);
+            }
+            continue;
+        }
+
+        normal = diffuse_normal(hit, normal, ray_direction);
+        total += throughput * importance(hit_point, hit.surface_index, k);
+        Vec3f albedo = s.albedo;
+        throughput *= (albedo.x + albedo.y + albedo.z) / 3.0f;
+        ray_origin = offset_ray_origin(hit_point, normal);
+        ray_direction = from_local(sample_unit_hemisphere(), normal);
+    }
+    return total;
+}
+
+int ImportanceMap::cells_per_light() {
+    return patches * patches * resolution * resolution;
+}
+
+// Returns the light of the cell
+int ImportanceMap::cell_sample(int cell, Vec3f &position, Vec3f &direction) {
+    int l = cell / cells_per_light();
+    const Light &light = scene.lights[l];
+    cell %= cells_per_light();
+    int patch = cell / (resolution * resolution);
+    int i = cell % (resolution * resolution) / resolution;
+    int j = cell % resolution;
+
+    float u = (patch / patches + random_uniform()) / patches;
+    float v = (patch % patches + random_uniform()) / patches;
+    position = light_point(light, u, v);
+    direction = from_local(sample_unit_hemisphere((i + random_uniform()) / resolution, (j + random_uniform()) / resolution), light.normal);
+    return l;
+}
+
+void ImportanceMap::build(int pilots_per_cell, int k) {
+    int num_cells = scene.lights.size() * cells_per_light();
+    std::vector<float> weights(num_cells, 0.0f);
+
+    if (!importons.empty()) {
+        for (int cell = 0; cell < num_cells; cell++) {
+            for (int n = 0; n < pilots_per_cell; n++) {
+                Vec3f position, direction;
+                int light = cell_sample(cell, position, direction);
+                weights[cell] += pilot(offset_ray_origin(position, scene.lights[light].normal), direction, k) / pilots_per_cell;
+            }
+        }
+    }
+
+    // Mix with power-proportional uniform emission so that no cell the pilots missed ends up with
+    // zero probability
+    float total = std::accumulate(weights.begin(), weights.end(), 0.0f);
+    for (int cell = 0; cell < num_cells; cell++) {
+        float uniform = light_probability(cell / cells_per_light()) / cells_per_light();
+        weights[cell] = total > 0 ? (1 - uniform_fraction) * weights[cell] / total + uniform_fraction * uniform : uniform;
+    }
+    distribution = Distribution1D(weights);
+}
+
+// weight is the ratio of the power-proportional uniform emission pdf to the importance pdf of the sampled cell
+int ImportanceMap::sample(Vec3f &position, Vec3f &direction, float &weight) {
+    int cell = distribution.sample(random_uniform());
+    weight = light_probability(cell / cells_per_light()) / (cells_per_light() * distribution.pdf(cell));
+    return cell_sample(cell, position, direction);
+}
@@ -1,6 +1,9 @@
+#pragma once
+
 #include "common.h"
+#include "stats.h"
 
-using NNQ = std::priority_queue<std::pair<float, int>>;
+using NNQ = std::priority_queue<std::pair<float, int64_t>>;
 
 class KDTree {
     public:
@@ -13,7 +16,8 @@ class KDTree {
         KDTree(std::vector<Photon>* given_photons);
         void balance();
         void balance(std::vector<int> &photon_indeces);
-        void locate_photons(Vec3f x, int k, int surface_index, NNQ &pq);
+        // Photons are queued as index_base + their index, so several trees can share one queue
+        void locate_photons(const Vec3f &x, int k, int surface_index, NNQ &pq, int64_t index_base = 0) const;
         void print();
 };
 
@@ -78,11 +82,14 @@ void KDTree::balance(std::vector<int> &photon_indeces) {
     }
 }
 
-void KDTree::locate_photons(Vec3f x, int k, int surface_index, NNQ &pq) {
-    Photon &photon = (*photons)[photon_index];
+void KDTree::locate_photons(const Vec3f &x, int k, int surface_index, NNQ &pq, int64_t index_base) const {
+    const Photon &photon = (*photons)[photon_index];
     float delta = linalg::length(photon.position - x);
-    if (photon.surface_id == surface_index)
-        pq.push(std::make_pair(delta, photon_index));
+    count_stat(KD_NODES_VISITED);
+    if (photon.surface_id == surface_index) {
+        count_stat(PHOTONS_EXAMINED);
+        pq.push(std::make_pair(delta, index_base + photon_index));
+    }
     if (pq.size() > k)
         pq.pop();
 
@@ -94,16 +101,16 @@ void KDTree::locate_photons(Vec3f x, int k, int surface_index, NNQ &pq) {
     delta = x[split_dimension] - photon.position[split_dimension];
 
     if (x[split_dimension] < photon.position[split_dimension]) {
-        if (left != nullptr) left->locate_photons(x, k, surface_index, pq);
+        if (left != nullptr) left->locate_photons(x, k, surface_index, pq, index_base);
     } else {
-        if (right != nullptr) right->locate_photons(x, k, surface_index, pq);
+        if (right != nullptr) right->locate_photons(x, k, surface_index, pq, index_base);
     }
 
     if (pq.size() < k || pq.top().first > fabsf(delta)) {
         if (x[split_dimension] < photon.position[split_dimension]) {
-            if (right != nullptr) right->locate_photons(x, k, surface_index, pq);
+            if (right != nullptr) right->locate_photons(x, k, surface_index, pq, index_base);
         } else {
-            if (left != nullptr) left->locate_photons(x, k, surface_index, pq);
+            if (left != nullptr) left->locate_photons(x, k, surface_index, pq, index_base);
         }
     }
 }
\ No newline at end of file
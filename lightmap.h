@@ -0,0 +1,217 @@
+#pragma once
+
+#include <stdexcept>
+#include <cstring>
+
+#include "common.h"
+#include "scene.h"
+
+const char LIGHTMAP_MAGIC[8] = {'P', 'M', 'L', 'M', 'A', 'P', '\0', '\0'};
+const uint32_t LIGHTMAP_VERSION = 2;
+
+// Texel grid over part of a surface. Planar charts cover the bounding rectangle of all the
+// triangles of a surface, origin + s * axis_u + t * axis_v for s, t in [0, 1]. Sphere charts
+// cover one sphere centered at origin in latitude/longitude.
+struct LightmapChart {
+    int type;
+    Vec3f origin;
+    Vec3f axis_u;
+    Vec3f axis_v;
+    float radius;
+    int resolution_u;
+    int resolution_v;
+    uint32_t first_texel;
+};
+
+// Baked photon map radiance (indirect plus caustic) of the static diffuse surfaces, keyed by surface_index
+class Lightmaps {
+    public:
+        std::vector<std::vector<LightmapChart>> charts;
+        std::vector<Vec3f> texels;
+        bool empty();
+        void build_charts(float texel_size);
+        template<typename Evaluate> void bake(Evaluate evaluate);
+        bool lookup(Vec3f p, const SceneElement &ele, Vec3f &radiance);
+        void write(const std::string &path);
+        void read(const std::string &path);
+    private:
+        Vec3f texel_position(const LightmapChart &chart, int i, int j, Vec3f &normal);
+        Vec3f bilinear(const LightmapChart &chart, float s, float t, bool wrap_u);
+};
+
+bool Lightmaps::empty() {
+    return texels.empty();
+}
+
+void Lightmaps::build_charts(float texel_size) {
+    charts = std::vector<std::vector<LightmapChart>>(scene.surfaces.size());
+    texels.clear();
+    uint32_t num_texels = 0;
+    auto add_chart = [&](int surface_index, LightmapChart chart) {
+        chart.first_texel = num_texels;
+        num_texels += chart.resolution_u * chart.resolution_v;
+        charts[surface_index].push_back(chart);
+    };
+
+    for (int surface_index = 0; surface_index < (int)scene.surfaces.size(); surface_index++) {
+        const Surface &s = scene.surfaces[surface_index];
+        if (s.type != LAMBERTIAN) continue;
+
+        auto [x, y] = coordinate_system(s.normal);
+        Vec2f bounds_min{__FLT_MAX__, __FLT_MAX__}, bounds_max = -bounds_min;
+        float plane_offset = 0;
+        bool planar = false;
+        for (const SceneElement &ele : scene.scene_elements) {
+            if (ele.surface_index != surface_index || is_emitter(ele)) continue;
+            if (ele.type == TRIANGLE) {
+                for (Vec3f p : {ele.p1, ele.p2, ele.p3}) {
+                    bounds_min = min(bounds_min, Vec2f{dot(p, x), dot(p, y)});
+                    bounds_max = max(bounds_max, Vec2f{dot(p, x), dot(p, y)});
+                }
+                plane_offset = dot(ele.p1, s.normal);
+                planar = true;
+            } else if (ele.type == SPHERE) {
+                int resolution_v = std::max(1, (int)ceilf(PI * ele.r / texel_size));
+                add_chart(surface_index, LightmapChart{SPHERE, ele.p1, Vec3f{}, Vec3f{}, ele.r, 2 * resolution_v, resolution_v});
+            }
+        }
+        if (planar) {
+            Vec2f extent = bounds_max - bounds_min;
+            add_chart(surface_index, LightmapChart{
+                TRIANGLE,
+                bounds_min.x * x + bounds_min.y * y + plane_offset * s.normal,
+                extent.x * x,
+                extent.y * y,
+                0,
+                std::max(1, (int)ceilf(extent.x / texel_size)),
+                std::max(1, (int)ceilf(extent.y / texel_size))
+            });
+        }
+    }
+    texels = std::vector<Vec3f>(num_texels, Vec3f{0, 0, 0});
+}
+
+Vec3f Lightmaps::texel_position(const LightmapChart &chart, int i, int j, Vec3f &normal) {
+    float s = (i + 0.5f) / chart.resolution_u;
+    float t = (j + 0.5f) / chart.resolution_v;
+    if (chart.type == SPHERE) {
+        float phi = 2 * PI * s;
+        float theta = PI * t;
+        normal = Vec3f{sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta)};
+        return chart.origin + chart.radius * normal;
+    }
+    return chart.origin + s * chart.axis_u + t * chart.axis_v;
+}
+
+// evaluate(p, ele) returns the photon map radiance at p, as shade() evaluates it for a hit on ele
+template<typename Evaluate>
+void Lightmaps::bake(Evaluate evaluate) {
+    for (int surface_index = 0; surface_index < (int)charts.size(); surface_index++) {
+        for (const LightmapChart &chart : charts[surface_index]) {
+            SceneElement ele{.type = chart.type, .p1 = chart.origin, .r = chart.radius, .surface_index = surface_index};
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (int j = 0; j < chart.resolution_v; j++) {
+                for (int i = 0; i < chart.resolution_u; i++) {
+                    Vec3f normal = scene.surfaces[surface_index].normal;
+                    Vec3f p = texel_position(chart, i, j, normal);
+                    texels[chart.first_texel + j * chart.resolution_u + i] = evaluate(offset_ray_origin(p, normal), ele);
+                }
+            }
+        }
+    }
+}
+
+Vec3f Lightmaps::bilinear(const LightmapChart &chart, float s, float t, bool wrap_u) {
+    float fu = s * chart.resolution_u - 0.5f;
+    float fv = std::clamp(t * chart.resolution_v - 0.5f, 0.0f, chart.resolution_v - 1.0f);
+    if (!wrap_u) fu = std::clamp(fu, 0.0f, chart.resolution_u - 1.0f);
+    int u0 = (int)floorf(fu), v0 = (int)floorf(fv);
+    float du = fu - u0, dv = fv - v0;
+    auto texel = [&](int u, int v) {
+        u = wrap_u ? (u % chart.resolution_u + chart.resolution_u) % chart.resolution_u : std::min(u, chart.resolution_u - 1);
+        v = std::min(v, chart.resolution_v - 1);
+        return texels[chart.first_texel + v * chart.resolution_u + u];
+    };
+    return (1 - dv) * ((1 - du) * texel(u0, v0) + du * texel(u0 + 1, v0)) + dv * ((1 - du) * texel(u0, v0 + 1) + du * texel(u0 + 1, v0 + 1));
+}
+
+// Baked radiance at p on ele, or false when ele's surface was not baked
+bool Lightmaps::lookup(Vec3f p, const SceneElement &ele, Vec3f &radiance) {
+    if (ele.type == MESH_TRIANGLE || (size_t)ele.surface_index >= charts.size()) return false;
+    for (const LightmapChart &chart : charts[ele.surface_index]) {
+        if (chart.type == SPHERE) {
+            if (ele.type != SPHERE || length2(chart.origin - ele.p1) > 1e-8f) continue;
+            Vec3f n = normalize(p - chart.origin);
+            float phi = atan2f(n.y, n.x);
+            radiance = bilinear(chart, (phi < 0 ? phi + 2 * PI : phi) / (2 * PI), acosf(std::clamp(n.z, -1.0f, 1.0f)) / PI, true);
+            return true;
+        }
+        if (ele.type != TRIANGLE) continue;
+        Vec3f d = p - chart.origin;
+        radiance = bilinear(chart, dot(d, chart.axis_u) / length2(chart.axis_u), dot(d, chart.axis_v) / length2(chart.axis_v), false);
+        return true;
+    }
+    return false;
+}
+
+void Lightmaps::write(const std::string &path) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot create " + path);
+    uint32_t num_surfaces = charts.size();
+    uint32_t num_elements = scene.scene_elements.size();
+    uint64_t num_texels = texels.size();
+    file.write(LIGHTMAP_MAGIC, sizeof(LIGHTMAP_MAGIC));
+    file.write((const char*)&LIGHTMAP_VERSION, sizeof(LIGHTMAP_VERSION));
+    uint32_t layout[2] = {sizeof(LightmapChart), sizeof(Vec3f)};
+    file.write((const char*)layout, sizeof(layout));
+    file.write((const char*)&num_surfaces, sizeof(num_surfaces));
+    file.write((const char*)&num_elements, sizeof(num_elements));
+    for (const std::vector<LightmapChart> &surface_charts : charts) {
+        uint32_t num_charts = surface_charts.size();
+        file.write((const char*)&num_charts, sizeof(num_charts));
+        file.write((const char*)surface_charts.data(), num_charts * sizeof(LightmapChart));
+    }
+    file.write((const char*)&num_texels, sizeof(num_texels));
+    file.write((const char*)texels.data(), num_texels * sizeof(Vec3f));
+    if (!file) throw std::runtime_error("failed writing " + path);
+}
+
+void Lightmaps::read(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot open " + path);
+    char magic[8];
+    uint32_t version, layout[2], num_surfaces, num_elements;
+    uint64_t num_texels;
+    file.read(magic, sizeof(magic));
+    file.read((char*)&version, sizeof(version));
+    file.read((char*)layout, sizeof(layout));
+    file.read((char*)&num_surfaces, sizeof(num_surfaces));
+    file.read((char*)&num_elements, sizeof(num_elements));
+    if (!file || memcmp(magic, LIGHTMAP_MAGIC, sizeof(magic)) != 0 || version != LIGHTMAP_VERSION) {
+        throw std::runtime_error(path + ": not a lightmap file");
+    }
+    if (layout[0] != sizeof(LightmapChart) || layout[1] != sizeof(Vec3f)) {
+        throw std::runtime_error(path + ": baked by a build with a different chart or texel layout");
+    }
+    if (num_surfaces != scene.surfaces.size() || num_elements != scene.scene_elements.size()) {
+        throw std::runtime_error(path + ": baked for a different scene");
+    }
+
+    charts = std::vector<std::vector<LightmapChart>>(num_surfaces);
+    uint32_t num_texels_in_charts = 0;
+    for (std::vector<LightmapChart> &surface_charts : charts) {
+        uint32_t num_charts = 0;
+        file.read((char*)&num_charts, sizeof(num_charts));
+        if (!file || num_charts > 1024) throw std::runtime_error(path + ": corrupt lightmap");
+        surface_charts = std::vector<LightmapChart>(num_charts);
+        file.read((char*)surface_charts.data(), surface_charts.size() * sizeof(LightmapChart));
+        for (const LightmapChart &chart : surface_charts) {
+            num_texels_in_charts = std::max(num_texels_in_charts, chart.first_texel + chart.resolution_u * chart.resolution_v);
+        }
+    }
+    file.read((char*)&num_texels, sizeof(num_texels));
+    if (!file || num_texels != num_texels_in_charts) throw std::runtime_error(path + ": corrupt lightmap");
+    texels = std::vector<Vec3f>(num_texels);
+    file.read((char*)texels.data(), num_texels * sizeof(Vec3f));
+    if (!file) throw std::runtime_error(path + ": truncated lightmap");
+}
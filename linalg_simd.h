@@ -0,0 +1,152 @@
+#pragma once
+
+// SSE-backed vec<float,3> and vec<float,4>, enabled by building with -DUSE_SIMD_VEC. Both are
+// 16-byte aligned; Vec3f carries a fourth lane that is kept at zero, which the divisions below
+// restore after computing 0/0 in it. Members, constructors and the generic linalg functions stay
+// as they are, the overloads below take over the hot operations.
+
+#include <immintrin.h>
+
+#include "linalg.h"
+
+#if !defined(__SSE2__) && !defined(_M_X64)
+#error "USE_SIMD_VEC needs SSE2"
+#endif
+
+namespace linalg
+{
+    template<> struct alignas(16) vec<float,3>
+    {
+        // The vector member makes the type travel in a single register
+        union {
+            struct { float          x,y,z; };
+            __m128                  m;
+        };
+        constexpr                   vec()                               : m() {}
+        constexpr                   vec(const float & x_, const float & y_,
+                                        const float & z_)               : m{x_, y_, z_, 0.0f} {}
+        constexpr                   vec(const vec<float,2> & xy,
+                                        const float & z_)               : vec(xy.x, xy.y, z_) {}
+        constexpr explicit          vec(const float & s)                : vec(s, s, s) {}
+        constexpr explicit          vec(const float * p)                : vec(p[0], p[1], p[2]) {}
+        template<class U>
+        constexpr explicit          vec(const vec<U,3> & v)             : vec(static_cast<float>(v.x), static_cast<float>(v.y), static_cast<float>(v.z)) {}
+        explicit                    vec(__m128 m_)                      : m(m_) {}
+        constexpr const float &     operator[] (int i) const            { return i==0?x:i==1?y:z; }
+        LINALG_CONSTEXPR14 float &  operator[] (int i)                  { return i==0?x:i==1?y:z; }
+        const vec<float,2> &        xy() const                          { return *reinterpret_cast<const vec<float,2> *>(this); }
+        vec<float,2> &              xy()                                { return *reinterpret_cast<vec<float,2> *>(this); }
+        __m128                      simd() const                        { return m; }
+
+        template<class U, class=detail::conv_t<vec,U>> constexpr vec(const U & u) : vec(converter<vec,U>{}(u)) {}
+        template<class U, class=detail::conv_t<U,vec>> constexpr operator U () const { return converter<U,vec>{}(*this); }
+    };
+    template<> struct alignas(16) vec<float,4>
+    {
+        union {
+            struct { float          x,y,z,w; };
+            __m128                  m;
+        };
+        constexpr                   vec()                               : m() {}
+        constexpr                   vec(const float & x_, const float & y_,
+                                        const float & z_, const float & w_) : m{x_, y_, z_, w_} {}
+        constexpr                   vec(const vec<float,2> & xy,
+                                        const float & z_, const float & w_) : vec(xy.x, xy.y, z_, w_) {}
+        constexpr                   vec(const vec<float,3> & xyz,
+                                        const float & w_)               : vec(xyz.x, xyz.y, xyz.z, w_) {}
+        constexpr explicit          vec(const float & s)                : vec(s, s, s, s) {}
+        constexpr explicit          vec(const float * p)                : vec(p[0], p[1], p[2], p[3]) {}
+        template<class U>
+        constexpr explicit          vec(const vec<U,4> & v)             : vec(static_cast<float>(v.x), static_cast<float>(v.y), static_cast<float>(v.z), static_cast<float>(v.w)) {}
+        explicit                    vec(__m128 m_)                      : m(m_) {}
+        constexpr const float &     operator[] (int i) const            { return i==0?x:i==1?y:i==2?z:w; }
+        LINALG_CONSTEXPR14 float &  operator[] (int i)                  { return i==0?x:i==1?y:i==2?z:w; }
+        const vec<float,2> &        xy() const                          { return *reinterpret_cast<const vec<float,2> *>(this); }
+        vec<float,2> &              xy()                                { return *reinterpret_cast<vec<float,2> *>(this); }
+        // Unlike the generic xyz(), this returns a copy, so that the Vec3f's padding lane is zero
+        vec<float,3>                xyz() const                         { return {x, y, z}; }
+        __m128                      simd() const                        { return m; }
+
+        template<class U, class=detail::conv_t<vec,U>> constexpr vec(const U & u) : vec(converter<vec,U>{}(u)) {}
+        template<class U, class=detail::conv_t<U,vec>> constexpr operator U () const { return converter<U,vec>{}(*this); }
+    };
+
+    namespace detail
+    {
+        // Sum of the x, y and z lanes, broadcast to every lane
+        inline __m128 sum3(__m128 m) {
+            __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1,1,1,1));
+            __m128 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2,2,2,2));
+            __m128 s = _mm_add_ss(_mm_add_ss(m, y), z);
+            return _mm_shuffle_ps(s, s, _MM_SHUFFLE(0,0,0,0));
+        }
+        inline __m128 sum4(__m128 m) {
+            __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2,3,0,1)));
+            return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1,0,3,2)));
+        }
+        // Zeroes the padding lane of a Vec3f result
+        inline __m128 mask3(__m128 m) {
+            return _mm_and_ps(m, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+        }
+        inline __m128 dot3(__m128 a, __m128 b) {
+#ifdef __SSE4_1__
+            return _mm_dp_ps(a, b, 0x7f);
+#else
+            return sum3(_mm_mul_ps(a, b));
+#endif
+        }
+    }
+
+    // Non-template overloads win over the generic templates for exact Vec3f and Vec4f arguments
+    inline vec<float,3> operator - (const vec<float,3> & a)                         { return vec<float,3>(_mm_sub_ps(_mm_setzero_ps(), a.simd())); }
+    inline vec<float,3> operator + (const vec<float,3> & a, const vec<float,3> & b) { return vec<float,3>(_mm_add_ps(a.simd(), b.simd())); }
+    inline vec<float,3> operator - (const vec<float,3> & a, const vec<float,3> & b) { return vec<float,3>(_mm_sub_ps(a.simd(), b.simd())); }
+    inline vec<float,3> operator * (const vec<float,3> & a, const vec<float,3> & b) { return vec<float,3>(_mm_mul_ps(a.simd(), b.simd())); }
+    inline vec<float,3> operator / (const vec<float,3> & a, const vec<float,3> & b) { return vec<float,3>(detail::mask3(_mm_div_ps(a.simd(), b.simd()))); }
+    inline vec<float,3> operator * (const vec<float,3> & a, float b)                { return vec<float,3>(_mm_mul_ps(a.simd(), _mm_set1_ps(b))); }
+    inline vec<float,3> operator * (float a, const vec<float,3> & b)                { return vec<float,3>(_mm_mul_ps(_mm_set1_ps(a), b.simd())); }
+    inline vec<float,3> operator / (const vec<float,3> & a, float b)                { return vec<float,3>(detail::mask3(_mm_div_ps(a.simd(), _mm_set1_ps(b)))); }
+    inline vec<float,3> operator / (float a, const vec<float,3> & b)                { return vec<float,3>(detail::mask3(_mm_div_ps(_mm_set1_ps(a), b.simd()))); }
+    inline vec<float,3> & operator += (vec<float,3> & a, const vec<float,3> & b)    { return a = a + b; }
+    inline vec<float,3> & operator -= (vec<float,3> & a, const vec<float,3> & b)    { return a = a - b; }
+    inline vec<float,3> & operator *= (vec<float,3> & a, float b)                   { return a = a * b; }
+    inline vec<float,3> & operator /= (vec<float,3> & a, float b)                   { return a = a / b; }
+    inline vec<float,3> min      (const vec<float,3> & a, const vec<float,3> & b)   { return vec<float,3>(_mm_min_ps(a.simd(), b.simd())); }
+    inline vec<float,3> max      (const vec<float,3> & a, const vec<float,3> & b)   { return vec<float,3>(_mm_max_ps(a.simd(), b.simd())); }
+    inline float        dot      (const vec<float,3> & a, const vec<float,3> & b)   { return _mm_cvtss_f32(detail::dot3(a.simd(), b.simd())); }
+    inline float        length2  (const vec<float,3> & a)                           { return dot(a, a); }
+    inline float        length   (const vec<float,3> & a)                           { return _mm_cvtss_f32(_mm_sqrt_ss(detail::dot3(a.simd(), a.simd()))); }
+    inline float        distance2(const vec<float,3> & a, const vec<float,3> & b)   { return length2(b - a); }
+    inline float        distance (const vec<float,3> & a, const vec<float,3> & b)   { return length(b - a); }
+    inline vec<float,3> normalize(const vec<float,3> & a) {
+        __m128 m = a.simd();
+        return vec<float,3>(detail::mask3(_mm_div_ps(m, _mm_sqrt_ps(detail::dot3(m, m)))));
+    }
+    inline vec<float,3> cross    (const vec<float,3> & a, const vec<float,3> & b) {
+        __m128 a_yzx = _mm_shuffle_ps(a.simd(), a.simd(), _MM_SHUFFLE(3,0,2,1)), b_yzx = _mm_shuffle_ps(b.simd(), b.simd(), _MM_SHUFFLE(3,0,2,1));
+        __m128 c = _mm_sub_ps(_mm_mul_ps(a.simd(), b_yzx), _mm_mul_ps(a_yzx, b.simd()));
+        return vec<float,3>(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1)));
+    }
+
+    inline vec<float,4> operator - (const vec<float,4> & a)                         { return vec<float,4>(_mm_sub_ps(_mm_setzero_ps(), a.simd())); }
+    inline vec<float,4> operator + (const vec<float,4> & a, const vec<float,4> & b) { return vec<float,4>(_mm_add_ps(a.simd(), b.simd())); }
+    inline vec<float,4> operator - (const vec<float,4> & a, const vec<float,4> & b) { return vec<float,4>(_mm_sub_ps(a.simd(), b.simd())); }
+    inline vec<float,4> operator * (const vec<float,4> & a, const vec<float,4> & b) { return vec<float,4>(_mm_mul_ps(a.simd(), b.simd())); }
+    inline vec<float,4> operator / (const vec<float,4> & a, const vec<float,4> & b) { return vec<float,4>(_mm_div_ps(a.simd(), b.simd())); }
+    inline vec<float,4> operator * (const vec<float,4> & a, float b)                { return vec<float,4>(_mm_mul_ps(a.simd(), _mm_set1_ps(b))); }
+    inline vec<float,4> operator * (float a, const vec<float,4> & b)                { return vec<float,4>(_mm_mul_ps(_mm_set1_ps(a), b.simd())); }
+    inline vec<float,4> operator / (const vec<float,4> & a, float b)                { return vec<float,4>(_mm_div_ps(a.simd(), _mm_set1_ps(b))); }
+    inline vec<float,4> & operator += (vec<float,4> & a, const vec<float,4> & b)    { return a = a + b; }
+    inline vec<float,4> & operator -= (vec<float,4> & a, const vec<float,4> & b)    { return a = a - b; }
+    inline vec<float,4> & operator *= (vec<float,4> & a, float b)                   { return a = a * b; }
+    inline vec<float,4> & operator /= (vec<float,4> & a, float b)                   { return a = a / b; }
+    inline vec<float,4> min      (const vec<float,4> & a, const vec<float,4> & b)   { return vec<float,4>(_mm_min_ps(a.simd(), b.simd())); }
+    inline vec<float,4> max      (const vec<float,4> & a, const vec<float,4> & b)   { return vec<float,4>(_mm_max_ps(a.simd(), b.simd())); }
+    inline float        dot      (const vec<float,4> & a, const vec<float,4> & b)   { return _mm_cvtss_f32(detail::sum4(_mm_mul_ps(a.simd(), b.simd()))); }
+    inline float        length2  (const vec<float,4> & a)                           { return dot(a, a); }
+    inline float        length   (const vec<float,4> & a)                           { return std::sqrt(length2(a)); }
+    inline vec<float,4> normalize(const vec<float,4> & a) {
+        __m128 m = a.simd();
+        return vec<float,4>(_mm_div_ps(m, _mm_sqrt_ps(detail::sum4(_mm_mul_ps(m, m)))));
+    }
+}
@@ -2,95 +2,78 @@
 #include "scene.h"
 #include "raytracer.h"
 #include "kdtree.h"
+#include "projection.h"
+#include "importance.h"
+#include "options.h"
+#include "photon_map.h"
+#include "mesh_loader.h"
+#include "scene_file.h"
+#include "lightmap.h"
+#include "camera.h"
+#include "server.h"
+#include "photon_cache.h"
+#include "distributed.h"
+#include "image_file.h"
+#include "checkpoint.h"
+#include "denoise.h"
+#include "stats.h"
+#include "diagnostics.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "stb_image_write.h"
 
-const int NUM_PHOTONS = 100000;
-const float LIGHT_POWER = 1;
 const float GLOSSY_CONSTANT = 0.1;
-const int K = 500;
-const int SPP = 1024;
+const int STREAM_BAND_HEIGHT = 32;
 
-std::vector<Photon> diffuse_photons;
-std::vector<Photon> caustic_photons;
 KDTree diffuse_kd;
 KDTree caustic_kd;
-
-void photon_trace(Vec3f ray_origin, Vec3f ray_direction, Vec3f incoming_power, bool diffuse = false, bool caustic = false) {
-    auto [hit, t, ele] = closest_hit(ray_origin, ray_direction, scene.scene_elements);
-
-    if (!hit) return;
-
-    Vec3f normal;
-    if (ele.type == TRIANGLE) {
-        normal = surface(ele).normal;
-    } else if (ele.type == SPHERE) {
-        normal = normal_sphere(ele, ray_origin + ray_direction * t);
-    }
-	Vec3f albedo = surface(ele).albedo;
-
-	if (surface(ele).type == LAMBERTIAN) {
-        if (diffuse && !caustic) {
-            diffuse_photons.push_back(Photon{ray_origin + t * ray_direction, -ray_direction, incoming_power, ele.surface_index});
-        } else if (caustic && !diffuse) {
-            caustic_photons.push_back(Photon{ray_origin + t * ray_direction, -ray_direction, incoming_power, ele.surface_index});
-        }
-        Vec3f albedo = surface(ele).albedo;
-        float p_rr = (albedo.x + albedo.y + albedo.z) / 3.0f;
-		if (random_uniform() < p_rr) { // Diffusely Reflected
-			ray_origin = offset_ray_origin(ray_origin + t * ray_direction, normal);
-			ray_direction = from_local(sample_unit_hemisphere(), normal);
-			photon_trace(ray_origin, ray_direction, incoming_power * albedo / p_rr, true, caustic);
-		}
-	} else if (surface(ele).type == CAUSTIC) {
-        if (dot(normal, ray_direction) > 0) { // Hit from behind
-            ray_origin = offset_ray_origin(ray_origin + t * ray_direction, normal);
-            ray_direction = photon_refract(-ray_direction, -normal, false);
-        } else { // Hit from front
-            ray_origin = offset_ray_origin(ray_origin + t * ray_direction, -normal);
-            ray_direction = photon_refract(-ray_direction, normal);
-        }
-        photon_trace(ray_origin, ray_direction, incoming_power, diffuse, true);
-	}
-}
-
-void map_photons() {
-    for (int i = 0; i < NUM_PHOTONS; i++) {
-        if (i % 100000 == 0) {
-            cout << i << endl;
-        }
-        Vec3f ray_origin = offset_ray_origin(sample_light_position(), scene.light_normal);
-        Vec3f ray_direction = from_local(sample_unit_hemisphere(), scene.light_normal);
-
-        photon_trace(ray_origin, ray_direction, Vec3f{LIGHT_POWER, LIGHT_POWER, LIGHT_POWER}/NUM_PHOTONS);
-    }
-}
-
-Vec3f eval_direct_lighting(Vec3f p, SceneElement ele) {
-    Surface s = surface(ele);
-    if (s.type != LAMBERTIAN) return Vec3f{0.0f, 0.0f, 0.0f};
-
-    Vec3f point_on_light = sample_light_position();
+Lightmaps lightmaps;
+
+// Photon gather of a --pipeline render, recorded while the photon maps are still being traced
+struct DeferredGather {
+    Vec3f position;
+    int surface_index;
+    int pixel;      // y * image_width + x
+    float weight;   // Throughput of the specular path from the camera
+};
+
+// Per rendering thread when deferring, empty otherwise. Each pixel is rendered by one thread, so
+// the lists can be resolved in parallel.
+std::vector<std::vector<DeferredGather>> deferred_thread_gathers;
+thread_local std::vector<DeferredGather>* deferred_gathers = nullptr;
+
+Vec3f eval_direct_lighting(Vec3f p, Vec3f normal, const Surface &s) {
+    int l = sample_light();
+    const Light &light = scene.lights[l];
+    Vec3f point_on_light = sample_light_position(light);
     Vec3f shadow_ray_direction = normalize(point_on_light - p);
-    auto [shadow_hit, shadow_t, shadow_ele] = closest_hit(p, shadow_ray_direction, scene.scene_elements);
+    count_stat(SHADOW_RAYS);
+    Hit shadow_hit = closest_hit(p, shadow_ray_direction, scene.scene_elements, scene.mesh_geometry);
 
-    if (!is_emitter(shadow_ele)) return Vec3f{0.0f, 0.0f, 0.0f};
+    if (!shadow_hit.found || shadow_hit.surface_index != light.surface_index) return Vec3f{0.0f, 0.0f, 0.0f};
 
     Vec3f brdf = s.albedo / PI;
-    Vec3f L_i = dot(-shadow_ray_direction, scene.light_normal) > 0 ? Vec3f{LIGHT_POWER * scene.inv_light_area, LIGHT_POWER * scene.inv_light_area, LIGHT_POWER * scene.inv_light_area} : Vec3f{0.0f, 0.0f, 0.0f};
-    float pdf_light = length2(p - point_on_light) * scene.inv_light_area / dot(scene.light_normal, normalize(p - point_on_light));
+    float radiance = light.power / light.area;
+    Vec3f L_i = dot(-shadow_ray_direction, light.normal) > 0 ? Vec3f{radiance, radiance, radiance} : Vec3f{0.0f, 0.0f, 0.0f};
+    float pdf_light = length2(p - point_on_light) / light.area / dot(light.normal, normalize(p - point_on_light)) * light_probability(l);
 
-    return brdf * L_i * dot(shadow_ray_direction, s.normal) / pdf_light;
+    return brdf * L_i * dot(shadow_ray_direction, normal) / pdf_light;
 }
 
-Vec3f eval_indirect_lighting(Vec3f p, SceneElement ele) {
-    Surface s = surface(ele);
-    if (s.type != LAMBERTIAN) return Vec3f{0.0f, 0.0f, 0.0f};
+Vec3f eval_indirect_lighting(Vec3f p, int surface_index) {
+    const Surface &s = scene.surfaces[surface_index];
+    if (s.type != LAMBERTIAN || (diffuse_photons.empty() && diffuse_store.empty())) return Vec3f{0.0f, 0.0f, 0.0f};
 
     NNQ nnq;
-    diffuse_kd.locate_photons(p, K, ele.surface_index, nnq);
+    BrickGather bricks;
+    count_stat(PHOTON_GATHERS);
+    if (diffuse_store.empty()) {
+        diffuse_kd.locate_photons(p, options.k, surface_index, nnq);
+    } else {
+        diffuse_store.locate_photons(p, options.k, surface_index, nnq, bricks);
+    }
+    record_gather(last_diffuse_gather, nnq.empty() ? 0.0f : nnq.top().first, nnq.size());
 
     if (nnq.empty()) return Vec3f{0,0,0};
 
@@ -99,9 +82,10 @@ Vec3f eval_indirect_lighting(Vec3f p, SceneElement ele) {
     Vec3f total_flux{0,0,0};
 
     Vec3f brdf;
-    brdf = surface(ele).albedo / PI;
+    brdf = s.albedo / PI;
     while (!nnq.empty()) {
-        total_flux += diffuse_photons[nnq.top().second].power * brdf;
+        const Photon &photon = bricks.bricks.empty() ? diffuse_photons[nnq.top().second] : bricks.photon(nnq.top().second);
+        total_flux += photon.power * brdf;
         nnq.pop();
     }
 
@@ -111,12 +95,19 @@ Vec3f eval_indirect_lighting(Vec3f p, SceneElement ele) {
 
 }
 
-Vec3f eval_caustic_lighting(Vec3f p, SceneElement ele) {
-    Surface s = surface(ele);
-    if (s.type != LAMBERTIAN) return Vec3f{0.0f, 0.0f, 0.0f};
+Vec3f eval_caustic_lighting(Vec3f p, int surface_index) {
+    const Surface &s = scene.surfaces[surface_index];
+    if (s.type != LAMBERTIAN || (caustic_photons.empty() && caustic_store.empty())) return Vec3f{0.0f, 0.0f, 0.0f};
 
     NNQ nnq;
-    caustic_kd.locate_photons(p, K, ele.surface_index, nnq);
+    BrickGather bricks;
+    count_stat(PHOTON_GATHERS);
+    if (caustic_store.empty()) {
+        caustic_kd.locate_photons(p, options.k, surface_index, nnq);
+    } else {
+        caustic_store.locate_photons(p, options.k, surface_index, nnq, bricks);
+    }
+    record_gather(last_caustic_gather, nnq.empty() ? 0.0f : nnq.top().first, nnq.size());
 
     if (nnq.empty()) return Vec3f{0,0,0};
 
@@ -125,9 +116,10 @@ Vec3f eval_caustic_lighting(Vec3f p, SceneElement ele) {
     Vec3f total_flux{0,0,0};
 
     Vec3f brdf;
-    brdf = surface(ele).albedo / PI;
+    brdf = s.albedo / PI;
     while (!nnq.empty()) {
-        total_flux += caustic_photons[nnq.top().second].power * brdf;
+        const Photon &photon = bricks.bricks.empty() ? caustic_photons[nnq.top().second] : bricks.photon(nnq.top().second);
+        total_flux += photon.power * brdf;
         nnq.pop();
     }
 
@@ -137,32 +129,25 @@ Vec3f eval_caustic_lighting(Vec3f p, SceneElement ele) {
 
 }
 
-Vec3f shade(Vec3f camera_position, Vec3f ray_direction, int i = -1, bool inside = false) {
-    auto [hit, t, ele] = closest_hit(camera_position, ray_direction, scene.scene_elements);
-    if (!hit) return Vec3f{0.0f, 0.0f, 0.0f};
-    if (is_emitter(ele)) return Vec3f{1.0f, 1.0f, 1.0f};
+Vec3f shade(Vec3f camera_position, Vec3f ray_direction, int i = -1, bool inside = false, int spp = options.spp, float weight = 1.0f);
 
-    Vec3f hit_point = camera_position + t * ray_direction;
-
-    Vec3f normal;
-    if (ele.type == SPHERE) {
-        normal = normal_sphere(ele, hit_point);
-    } else {
-        normal = surface(ele).normal;
-    }
-
-    if (surface(ele).type == CAUSTIC) {
+// Radiance leaving a hit on a MATERIAL surface. shade() looks the material up once per hit and
+// calls the matching instantiation, so the branches below are resolved at compile time.
+template<uint8_t MATERIAL>
+Vec3f shade_surface(const Hit &hit, const Surface &s, Vec3f hit_point, Vec3f normal, Vec3f ray_direction, int i, bool inside, int spp, float weight) {
+    if constexpr (MATERIAL == CAUSTIC) {
+        count_stat(CAUSTIC_HITS);
         Vec3f L_r_specular{0.0f, 0.0f, 0.0f};
         if (!inside) {
             Vec3f mirror_ray_origin, mirror_ray_direction;
             if (dot(normal, ray_direction) > 0) { // Hit from behind
                 mirror_ray_origin = offset_ray_origin(hit_point, -normal);
-                ray_direction = mirror_reflect(ray_direction, -normal);
+                mirror_ray_direction = mirror_reflect(ray_direction, -normal);
             } else { // Hit from front
                 mirror_ray_origin = offset_ray_origin(hit_point, normal);
                 mirror_ray_direction = mirror_reflect(ray_direction, normal);
             }
-            L_r_specular = shade(mirror_ray_origin, mirror_ray_direction, i) * 0.05f;
+            L_r_specular = shade(mirror_ray_origin, mirror_ray_direction, i, false, spp, weight * 0.05f) * 0.05f;
         }
         Vec3f ray_origin;
         if (dot(normal, ray_direction) > 0) { // Hit from behind
@@ -172,34 +157,55 @@ Vec3f shade(Vec3f camera_position, Vec3f ray_direction, int i = -1, bool inside
             ray_origin = offset_ray_origin(hit_point, -normal);
             ray_direction = photon_refract(-ray_direction, normal);
         }
-        return L_r_specular + shade(ray_origin, ray_direction, i, !inside);
-    }
+        return L_r_specular + shade(ray_origin, ray_direction, i, !inside, spp, weight);
+    } else {
+        normal = diffuse_normal(hit, normal, ray_direction);
+        hit_point = offset_ray_origin(hit_point, normal);
+        Vec3f L_r_direct{0.0f, 0.0f, 0.0f};
+        if constexpr (MATERIAL == LAMBERTIAN) {
+            L_r_direct = eval_direct_lighting(hit_point, normal, s);
+        }
+        Vec3f L_r_indirect{0.0f, 0.0f, 0.0f};
+        Vec3f L_r_caustic{0.0f, 0.0f, 0.0f};
+        if (hit.type != MESH_TRIANGLE && lightmaps.lookup(hit_point, scene.scene_elements[hit.index], L_r_indirect)) {
+            // Baked indirect and caustic lighting is cheap enough to fetch on every sample
+        } else if (i == 0 && deferred_gathers != nullptr) {
+            deferred_gathers->push_back(DeferredGather{hit_point, hit.surface_index, 0, weight});
+        } else if (i == 0) {
+            L_r_indirect = eval_indirect_lighting(hit_point, hit.surface_index) * spp;
+            L_r_caustic = eval_caustic_lighting(hit_point, hit.surface_index) * spp;
+        } else if (i == -1) {
+            L_r_indirect = eval_indirect_lighting(hit_point, hit.surface_index);
+            L_r_caustic = eval_caustic_lighting(hit_point, hit.surface_index);
+        }
 
-    hit_point = offset_ray_origin(hit_point, normal);
-    Vec3f L_r_direct{0.0f, 0.0f, 0.0f};
-    if (surface(ele).type == LAMBERTIAN) {
-        L_r_direct = eval_direct_lighting(hit_point, ele);
-    }
-    Vec3f L_r_indirect{0.0f, 0.0f, 0.0f};
-    Vec3f L_r_caustic{0.0f, 0.0f, 0.0f};
-    if (i == 0) {
-        L_r_indirect = eval_indirect_lighting(hit_point, ele) * SPP;
-        L_r_caustic = eval_caustic_lighting(hit_point, ele) * SPP;
-    } else if (i == -1) {
-        L_r_indirect = eval_indirect_lighting(hit_point, ele);
-        L_r_caustic = eval_caustic_lighting(hit_point, ele);
+        return L_r_direct + L_r_indirect + L_r_caustic;
     }
+}
 
-    return L_r_direct + L_r_indirect + L_r_caustic;
+Vec3f shade(Vec3f camera_position, Vec3f ray_direction, int i, bool inside, int spp, float weight) {
+    count_stat(CAMERA_RAYS);
+    Hit hit = closest_hit(camera_position, ray_direction, scene.scene_elements, scene.mesh_geometry);
+    if (!hit.found) return Vec3f{0.0f, 0.0f, 0.0f};
+    if (is_emitter(hit)) return Vec3f{1.0f, 1.0f, 1.0f};
+
+    Vec3f hit_point = camera_position + hit.t * ray_direction;
+    Vec3f normal = hit_normal(hit, hit_point);
+    const Surface &s = surface(hit);
+    switch (s.type) {
+        case LAMBERTIAN: return shade_surface<LAMBERTIAN>(hit, s, hit_point, normal, ray_direction, i, inside, spp, weight);
+        case CAUSTIC: return shade_surface<CAUSTIC>(hit, s, hit_point, normal, ray_direction, i, inside, spp, weight);
+        default: return shade_surface<GLOSSY>(hit, s, hit_point, normal, ray_direction, i, inside, spp, weight);
+    }
 }
 
-void visualize_photons(std::vector<Photon> &photons, char const * filename) {
+void visualize_photons(std::vector<Photon> &photons, KDTree &kd, char const * filename) {
+    if (photons.empty()) return;
+
     std::vector<bool> photon_selected(photons.size(), false);
 
     NNQ nnq;
-    KDTree kd(&photons);
-    kd.balance();
-    kd.locate_photons(Vec3f{0.27,-0.56,0.27}, K, 1, nnq);
+    kd.locate_photons(Vec3f{0.27,-0.56,0.27}, options.k, 1, nnq);
     while (!nnq.empty()) {
         photon_selected[nnq.top().second] = true;
         nnq.pop();
@@ -226,49 +232,323 @@ void visualize_photons(std::vector<Photon> &photons, char const * filename) {
     stbi_write_png(filename, scene.image_width, scene.image_height, 3, data.data(), 3 * scene.image_width);
 }
 
-int main() {
-    std::cout << "Starting Photon Mapping" << std::endl;
+// Reads the photon maps from --photon-cache when it exists, otherwise traces them and fills the cache
+void load_or_map_photons() {
+    if (!options.photon_store_prefix.empty()) {
+        photon_brick_cache.capacity_bytes = options.photon_store_cache_mb * 1024 * 1024;
+        try {
+            if (!open_photon_stores(options.photon_store_prefix)) {
+                map_photons();
+                open_photon_stores(options.photon_store_prefix);
+            }
+        } catch (const std::exception &e) {
+            cout << "Failed to open photon store: " << e.what() << endl;
+            exit(1);
+        }
+        cout << "Photon store " << options.photon_store_prefix << " holds " << diffuse_store.size() << " diffuse and "
+             << caustic_store.size() << " caustic photons" << endl;
+        return;
+    }
+
+    if (!options.photon_cache_file.empty()) {
+        try {
+            if (read_photon_cache(options.photon_cache_file, diffuse_photons, caustic_photons)) {
+                cout << "Loaded " << diffuse_photons.size() << " diffuse and " << caustic_photons.size()
+                     << " caustic photons from " << options.photon_cache_file << endl;
+                return;
+            }
+        } catch (const std::exception &e) {
+            cout << "Failed to load photon cache: " << e.what() << endl;
+            exit(1);
+        }
+    }
 
     map_photons();
 
-    caustic_kd = KDTree(&caustic_photons);
-    caustic_kd.balance();
+    if (!options.photon_cache_file.empty()) {
+        try {
+            write_photon_cache(options.photon_cache_file, diffuse_photons, caustic_photons);
+        } catch (const std::exception &e) {
+            cout << "Failed to write photon cache: " << e.what() << endl;
+            exit(1);
+        }
+        cout << "Photon cache written to " << options.photon_cache_file << endl;
+    }
+}
+
+const int MORTON_PIXEL_CHUNK = 64; // Pixels a thread takes at a time, 8x8 blocks of the curve
+
+// (x, y) offsets of a width by height block of pixels, sorted along a Morton curve
+void morton_pixel_order(int width, int height, std::vector<std::pair<int, int>> &order) {
+    std::vector<std::pair<uint32_t, std::pair<int, int>>> keys;
+    keys.reserve(width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) keys.push_back({morton_code_2d(x, y), {x, y}});
+    }
+    std::sort(keys.begin(), keys.end());
+    order.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) order[i] = keys[i].second;
+}
 
-    diffuse_kd = KDTree(&diffuse_photons);
-    diffuse_kd.balance();
+// Renders region in bands of band_height rows. Each band's pixels are rendered in parallel along a
+// Morton curve, so that a thread's consecutive pixels, and their photon gathers, are close together
+// in the scene. Every pass of a pixel draws from its own random stream, so passes can be accumulated
+// and the traversal order does not change the image. Only the band
+// in flight is held in memory: band_done(first_row, end_row, band) gets its pixels row-major with
+// region.width() pixels per row as each band completes.
+template<typename BandDone>
+void render_region(ImageRegion region, int spp, int pass, int band_height, BandDone band_done) {
+    std::vector<Vec3f> band;
+    std::vector<std::pair<int, int>> order;
+    for (int band_start = region.y0; band_start < region.y1; band_start += band_height) {
+        int band_end = std::min(band_start + band_height, region.y1);
+        band.assign((band_end - band_start) * region.width(), Vec3f{0.0f, 0.0f, 0.0f});
+        morton_pixel_order(region.width(), band_end - band_start, order);
+        #pragma omp parallel for schedule(dynamic, MORTON_PIXEL_CHUNK)
+        for (size_t j = 0; j < order.size(); j++) {
+            int x = region.x0 + order[j].first;
+            int y = band_start + order[j].second;
+            Vec3f &pixel = band[(y - band_start) * region.width() + x - region.x0];
+            seed_random(random_seed + pass, (uint64_t)y * scene.image_width + x + 1);
+            PixelProbe probe = start_pixel_probe();
+            if (!deferred_thread_gathers.empty()) deferred_gathers = &deferred_thread_gathers[omp_get_thread_num()];
+            size_t first_gather = deferred_gathers == nullptr ? 0 : deferred_gathers->size();
+            for (int i = 0; i < spp; i++) {
+                float u = ((float)x + random_uniform())/scene.image_width;
+                float v = ((float)y + random_uniform())/scene.image_height;
+                Vec3f ray_direction = camera_ray_direction(u, v);
+                pixel += shade(scene.camera_position, ray_direction, i, false, spp);
+            }
+            pixel /= (float)spp;
+            if (deferred_gathers != nullptr) {
+                for (size_t g = first_gather; g < deferred_gathers->size(); g++) (*deferred_gathers)[g].pixel = y * scene.image_width + x;
+                deferred_gathers = nullptr;
+            }
+            if (!pixel_diagnostics.empty()) finish_pixel_probe(probe, spp, pixel_diagnostics[y * scene.image_width + x]);
+        }
+        band_done(band_start, band_end, band.data());
+    }
+}
 
-    visualize_photons(caustic_photons, "caustic.png");
-    visualize_photons(diffuse_photons, "diffuse.png");
+ImageRegion frame_region() {
+    return ImageRegion{0, 0, scene.image_width, scene.image_height};
+}
+
+void render_frame(std::vector<Vec3f> &pixels) {
+    ScopedPhase phase("rendering");
+    std::cout << "Rendering Starting" << std::endl;
+
+    // Up to 16 chunks of rows, the last one shorter when the height is not a multiple of the chunk height
+    int chunk_height = (scene.image_height + 15) / 16;
+    int num_chunks = (scene.image_height + chunk_height - 1) / chunk_height;
+    pixels.assign(scene.image_width * scene.image_height, Vec3f{-1.0f, -1.0f, -1.0f});
+    render_region(frame_region(), options.spp, 0, chunk_height, [&](int band_start, int band_end, const Vec3f* band) {
+        std::copy(band, band + (band_end - band_start) * scene.image_width, &pixels[band_start * scene.image_width]);
+        cout << "Chunk " << band_start / chunk_height + 1 << "/" << num_chunks << " complete" << endl;
+    });
+}
+
+// Adds the photon gathers a --pipeline render deferred, now that the photon maps are built
+void resolve_deferred_gathers(std::vector<Vec3f> &pixels) {
+    ScopedPhase phase("deferred_gathers");
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t t = 0; t < deferred_thread_gathers.size(); t++) {
+        for (const DeferredGather &gather : deferred_thread_gathers[t]) {
+            Vec3f L_r = eval_indirect_lighting(gather.position, gather.surface_index) + eval_caustic_lighting(gather.position, gather.surface_index);
+            pixels[gather.pixel] += gather.weight * L_r;
+        }
+    }
+    deferred_thread_gathers.clear();
+}
 
-    std::cout << "Photon Mapping Complete" << std::endl;
+// Renders the frame straight into an image file, holding only STREAM_BAND_HEIGHT rows in memory
+void render_frame_to_file(ScanlineImageFile &image) {
+    ScopedPhase phase("rendering");
+    std::cout << "Rendering Starting" << std::endl;
 
-    std::vector<Vec3f> pixels(scene.image_width * scene.image_height, Vec3f{-1.0f, -1.0f, -1.0f});
+    ImageRegion region = frame_region();
+    render_region(region, options.spp, 0, STREAM_BAND_HEIGHT, [&](int band_start, int band_end, const Vec3f* band) {
+        image.write_block(ImageRegion{region.x0, band_start, region.x1, band_end}, band);
+        cout << "Rows " << band_end << "/" << region.y1 << " written" << endl;
+    });
+}
 
+// Renders the frame in passes of checkpoint.pass_spp samples per pixel, accumulated into checkpoint
+// from wherever it stopped. After a band finishes, the checkpoint is written to --checkpoint if the
+// last write is more than --checkpoint-interval seconds old.
+void render_frame_in_passes(RenderCheckpoint &checkpoint, std::vector<Vec3f> &pixels) {
+    ScopedPhase phase("rendering");
     std::cout << "Rendering Starting" << std::endl;
 
-    int chunk_height = scene.image_height / 16;
-    for (int i = 0; i < 16; i++) {
-        #pragma omp parallel for
-        for (int y = chunk_height * i; y < chunk_height * i + chunk_height; y++) {
-            if (y % 5 == 0) {
-                std::cout << "Rendering Row " << y << std::endl;
+    ImageRegion region = frame_region();
+    int num_passes = (checkpoint.spp + checkpoint.pass_spp - 1) / checkpoint.pass_spp;
+    auto last_write = std::chrono::steady_clock::now();
+    for (int pass = checkpoint.next_pass; pass < num_passes; pass++) {
+        int pass_spp = std::min(checkpoint.pass_spp, checkpoint.spp - pass * checkpoint.pass_spp);
+        ImageRegion remaining = region;
+        remaining.y0 = std::max(region.y0, (int)checkpoint.next_row);
+        render_region(remaining, pass_spp, pass, STREAM_BAND_HEIGHT, [&](int band_start, int band_end, const Vec3f* band) {
+            for (int y = band_start; y < band_end; y++) {
+                for (int x = region.x0; x < region.x1; x++) {
+                    checkpoint.radiance[y * scene.image_width + x] += (float)pass_spp * band[(y - band_start) * region.width() + x - region.x0];
+                    checkpoint.samples[y * scene.image_width + x] += pass_spp;
+                }
             }
-            for (int x = 0; x < scene.image_width; x++) {
-                pixels[y * scene.image_width + x] = Vec3f{0.0f, 0.0f, 0.0f};
-                for (int i = 0; i < SPP; i++) {
-                    float u = ((float)x + random_uniform())/scene.image_width;
-                    float v = ((float)y + random_uniform())/scene.image_height;
-                    Vec3f position_on_image_plane = scene.ip_bottom_left + u * scene.ip_right_vector + (1.0f - v) * scene.ip_up_vector;
-                    Vec3f ray_direction = linalg::normalize(position_on_image_plane - scene.camera_position);
-                    pixels[y * scene.image_width + x] += shade(scene.camera_position, ray_direction, i);
+            checkpoint.next_pass = band_end == region.y1 ? pass + 1 : pass;
+            checkpoint.next_row = band_end == region.y1 ? region.y0 : band_end;
+
+            std::chrono::duration<float> since_write = std::chrono::steady_clock::now() - last_write;
+            if (since_write.count() >= options.checkpoint_interval) {
+                checkpoint.write(options.checkpoint_file);
+                last_write = std::chrono::steady_clock::now();
+                cout << "Checkpoint written at pass " << checkpoint.next_pass + 1 << ", row " << checkpoint.next_row << endl;
+            }
+        });
+        cout << "Pass " << pass + 1 << "/" << num_passes << " complete" << endl;
+    }
+
+    pixels.assign(scene.image_width * scene.image_height, Vec3f{-1.0f, -1.0f, -1.0f});
+    for (int y = region.y0; y < region.y1; y++) {
+        for (int x = region.x0; x < region.x1; x++) {
+            int i = y * scene.image_width + x;
+            pixels[i] = checkpoint.radiance[i] / (float)std::max(checkpoint.samples[i], 1u);
+        }
+    }
+}
+
+// Relative difference of two independent estimates of the image, averaged over the pixels. It
+// tracks the remaining noise of their average and falls like 1 / sqrt(samples).
+float estimate_noise(const std::vector<Vec3f> &a, const std::vector<Vec3f> &b, ImageRegion region) {
+    double total = 0;
+    for (int y = region.y0; y < region.y1; y++) {
+        for (int x = region.x0; x < region.x1; x++) {
+            int i = y * scene.image_width + x;
+            float la = dot(a[i], Vec3f{0.2126f, 0.7152f, 0.0722f});
+            float lb = dot(b[i], Vec3f{0.2126f, 0.7152f, 0.0722f});
+            total += fabsf(la - lb) / (la + lb + 0.01f);
+        }
+    }
+    return total / std::max(1, region.width() * region.height());
+}
+
+// Renders passes of 1, 1, 2, 2, 4, 4, ... samples per pixel into two alternating accumulation
+// buffers and calls write_preview after each pass with pixels holding the image so far. Stops at
+// --spp samples, when the next pass would overrun --time-budget, or once the difference between the
+// two buffers falls below --noise-target.
+template<typename WritePreview>
+void render_frame_progressive(std::vector<Vec3f> &pixels, WritePreview write_preview) {
+    ScopedPhase phase("rendering");
+    std::cout << "Rendering Starting" << std::endl;
+
+    ImageRegion region = frame_region();
+    std::vector<Vec3f> sums[2];
+    int samples[2] = {0, 0};
+    for (std::vector<Vec3f> &sum : sums) sum.assign(scene.image_width * scene.image_height, Vec3f{0.0f, 0.0f, 0.0f});
+    pixels.assign(scene.image_width * scene.image_height, Vec3f{-1.0f, -1.0f, -1.0f});
+
+    // Pass time is modelled as a fixed cost (camera rays, photon gathers) plus a cost per sample, fitted
+    // to the last two passes with different sample counts
+    auto start = std::chrono::steady_clock::now();
+    float fixed_seconds = 0, seconds_per_sample = 0, last_pass_seconds = 0;
+    int last_pass_spp = 0;
+    for (int pass = 0; samples[0] + samples[1] < options.spp; pass++) {
+        int pass_spp = std::min(1 << (pass / 2), options.spp - samples[0] - samples[1]);
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+        float projected = fixed_seconds + seconds_per_sample * pass_spp;
+        if (options.time_budget > 0 && pass > 0 && elapsed.count() + projected > options.time_budget) {
+            cout << "Stopping before pass " << pass + 1 << ", it would overrun the time budget" << endl;
+            break;
+        }
+
+        auto pass_start = std::chrono::steady_clock::now();
+        std::vector<Vec3f> &sum = sums[pass % 2];
+        render_region(region, pass_spp, pass, STREAM_BAND_HEIGHT, [&](int band_start, int band_end, const Vec3f* band) {
+            for (int y = band_start; y < band_end; y++) {
+                for (int x = region.x0; x < region.x1; x++) {
+                    sum[y * scene.image_width + x] += (float)pass_spp * band[(y - band_start) * region.width() + x - region.x0];
                 }
-                pixels[y * scene.image_width + x] /= (float)SPP;
-                pixels[y * scene.image_width + x] = pixels[y * scene.image_width + x];
             }
+        });
+        samples[pass % 2] += pass_spp;
+        float pass_seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - pass_start).count();
+        if (pass == 0) {
+            seconds_per_sample = pass_seconds / pass_spp;
+        } else if (pass_spp != last_pass_spp) {
+            seconds_per_sample = std::max(0.0f, (pass_seconds - last_pass_seconds) / (pass_spp - last_pass_spp));
+            fixed_seconds = std::max(0.0f, pass_seconds - seconds_per_sample * pass_spp);
+        }
+        last_pass_seconds = pass_seconds;
+        last_pass_spp = pass_spp;
+
+        for (int y = region.y0; y < region.y1; y++) {
+            for (int x = region.x0; x < region.x1; x++) {
+                int i = y * scene.image_width + x;
+                pixels[i] = (sums[0][i] + sums[1][i]) / (float)(samples[0] + samples[1]);
+            }
+        }
+        write_preview();
+
+        cout << "Pass " << pass + 1 << " done, " << samples[0] + samples[1] << " spp in "
+             << std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() << "s";
+        if (samples[0] == samples[1]) {
+            std::vector<Vec3f> means[2];
+            for (int k = 0; k < 2; k++) {
+                means[k].resize(sums[k].size());
+                for (size_t i = 0; i < sums[k].size(); i++) means[k][i] = sums[k][i] / (float)samples[k];
+            }
+            float noise = estimate_noise(means[0], means[1], region);
+            cout << ", noise " << noise << endl;
+            if (noise < options.noise_target) break;
+        } else {
+            cout << endl;
+        }
+    }
+}
+
+// Same image as render_frame, rendered tile by tile on the workers. Tiles go straight to image when
+// there is one, otherwise into pixels.
+void render_frame_on_workers(std::vector<std::unique_ptr<WorkerProcess>> &workers, const CameraPose* pose,
+                             std::vector<Vec3f> &pixels, ScanlineImageFile* image) {
+    ScopedPhase phase("rendering");
+    std::ostringstream job;
+    job << std::setprecision(9) << "render width=" << scene.image_width << " height=" << scene.image_height << " spp=" << options.spp;
+    if (pose != nullptr) {
+        job << " camera=" << pose->position.x << "," << pose->position.y << "," << pose->position.z << "," << pose->target.x << ","
+            << pose->target.y << "," << pose->target.z << "," << pose->vertical_fov;
+    }
+
+    if (image == nullptr) pixels.assign(scene.image_width * scene.image_height, Vec3f{-1.0f, -1.0f, -1.0f});
+    render_tiles(workers, job.str(), frame_region(), [&](ImageRegion tile, const Vec3f* tile_pixels) {
+        if (image != nullptr) {
+            image->write_block(tile, tile_pixels);
+            return;
         }
-        cout << "Chunk " << i + 1 << "/16 complete" << endl;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            std::copy_n(&tile_pixels[(y - tile.y0) * tile.width()], tile.width(), &pixels[y * scene.image_width + tile.x0]);
+        }
+    });
+}
+
+// Starts --workers copies of this program as --serve workers with the same options and seed
+std::vector<std::unique_ptr<WorkerProcess>> start_workers(int argc, char **argv) {
+    std::vector<std::string> args;
+    for (int i = 0; i < argc; i++) {
+        if (std::string(argv[i]) == "--workers" || std::string(argv[i]) == "--stats") {
+            i++;
+            continue;
+        }
+        args.push_back(argv[i]);
     }
+    args.insert(args.end(), {"--serve", "--seed", std::to_string(random_seed)});
 
+    std::vector<std::unique_ptr<WorkerProcess>> workers;
+    for (int i = 0; i < options.num_workers; i++) {
+        workers.push_back(std::make_unique<WorkerProcess>(args));
+    }
+    return workers;
+}
+
+void write_png(const std::vector<Vec3f> &pixels, char const * filename) {
     std::vector<uint8_t> data(4 * scene.image_width * scene.image_height);
     for (int i = 0; i < scene.image_width * scene.image_height; i++) {
         if (pixels[i][0] == -1.0f) {
@@ -284,6 +564,372 @@ int main() {
         }
         data[4 * i + 3] = 255;
     }
-    stbi_write_png("output.png", scene.image_width, scene.image_height, 4, data.data(), 4 * scene.image_width);
-    // std::cout << "Success" << std::endl;
-}
\ No newline at end of file
+    stbi_write_png(filename, scene.image_width, scene.image_height, 4, data.data(), 4 * scene.image_width);
+}
+
+// Writes the feature buffers as stem_albedo.pfm, stem_normal.pfm, stem_depth.pfm and stem_surface.pfm
+void write_aovs(const std::vector<PixelFeatures> &features, const std::string &stem) {
+    ImageRegion region = frame_region();
+    std::vector<Vec3f> buffer(features.size());
+    auto write = [&](const char* name, auto value) {
+        for (size_t i = 0; i < features.size(); i++) buffer[i] = value(features[i]);
+        ScanlineImageFile(stem + "_" + name + ".pfm", scene.image_width, scene.image_height, PFM_FORMAT).write_block(region, buffer.data());
+    };
+    write("albedo", [](const PixelFeatures &f) { return f.albedo; });
+    write("normal", [](const PixelFeatures &f) { return f.normal; });
+    write("depth", [](const PixelFeatures &f) { return Vec3f{f.depth, f.depth, f.depth}; });
+    write("surface", [](const PixelFeatures &f) { return Vec3f{(float)f.surface_id, (float)f.surface_id, (float)f.surface_id}; });
+}
+
+// Writes the per-pixel costs as stem_time.pfm (cycles), stem_kd_nodes.pfm, stem_gather_radius.pfm and
+// stem_photons_found.pfm (diffuse in red, caustic in green, averaged over gathers) and stem_caustic_depth.pfm
+// (CAUSTIC hits per sample), and stem_time_heatmap.png scaled to the 99th percentile render time
+void write_diagnostics(const std::string &stem) {
+    ImageRegion region = frame_region();
+    std::vector<Vec3f> buffer(pixel_diagnostics.size());
+    auto write = [&](const char* name, auto value) {
+        for (size_t i = 0; i < pixel_diagnostics.size(); i++) buffer[i] = value(pixel_diagnostics[i]);
+        ScanlineImageFile(stem + "_" + name + ".pfm", scene.image_width, scene.image_height, PFM_FORMAT).write_block(region, buffer.data());
+    };
+    auto average = [](float sum, uint32_t n) { return n == 0 ? 0.0f : sum / n; };
+    write("time", [](const PixelDiagnostics &d) { return Vec3f{(float)d.cycles, (float)d.cycles, (float)d.cycles}; });
+    write("kd_nodes", [](const PixelDiagnostics &d) { return Vec3f{(float)d.kd_nodes_visited, (float)d.kd_nodes_visited, (float)d.kd_nodes_visited}; });
+    write("gather_radius", [&](const PixelDiagnostics &d) {
+        return Vec3f{average(d.diffuse_radius, d.diffuse_gathers), average(d.caustic_radius, d.caustic_gathers), 0.0f};
+    });
+    write("photons_found", [&](const PixelDiagnostics &d) {
+        return Vec3f{average(d.diffuse_found, d.diffuse_gathers), average(d.caustic_found, d.caustic_gathers), 0.0f};
+    });
+    write("caustic_depth", [&](const PixelDiagnostics &d) {
+        float depth = average((float)d.caustic_hits, d.samples);
+        return Vec3f{depth, depth, depth};
+    });
+
+    std::vector<double> cycles(pixel_diagnostics.size());
+    for (size_t i = 0; i < cycles.size(); i++) cycles[i] = pixel_diagnostics[i].cycles;
+    std::nth_element(cycles.begin(), cycles.begin() + cycles.size() * 99 / 100, cycles.end());
+    double scale = std::max(cycles[cycles.size() * 99 / 100], 1.0);
+    std::vector<uint8_t> data(3 * pixel_diagnostics.size());
+    for (size_t i = 0; i < pixel_diagnostics.size(); i++) {
+        Vec3f color = heat_color(pixel_diagnostics[i].cycles / scale);
+        for (int j = 0; j < 3; j++) data[3 * i + j] = (uint8_t)(255.0f * color[j]);
+    }
+    std::string heatmap = stem + "_time_heatmap.png";
+    if (!stbi_write_png(heatmap.c_str(), scene.image_width, scene.image_height, 3, data.data(), 3 * scene.image_width)) {
+        throw std::runtime_error("cannot write " + heatmap);
+    }
+}
+
+void load_scene() {
+    ScopedPhase phase("scene_load");
+    auto start = std::chrono::steady_clock::now();
+    if (!options.scene_file.empty()) {
+        try {
+            map_scene_file(options.scene_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to load scene: " << e.what() << endl;
+            exit(1);
+        }
+        update_lights();
+        cout << "Mapped " << options.scene_file << " with " << scene.mesh_geometry.num_triangles() << " mesh triangles in "
+             << std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() << "s" << endl;
+        return;
+    }
+    scene.lights[0].power = options.light_power;
+    for (const LightSpec &spec : options.lights) {
+        add_light(spec.triangle ? TRIANGLE_LIGHT : QUAD_LIGHT, spec.corner, spec.edge_u, spec.edge_v, spec.power);
+    }
+    update_lights();
+    if (options.meshes.empty()) return;
+
+    for (const MeshSpec &spec : options.meshes) {
+        try {
+            add_mesh_file(spec.path, Surface{.type = spec.caustic ? CAUSTIC : LAMBERTIAN, .albedo = spec.albedo}, spec.scale, spec.offset);
+        } catch (const std::exception &e) {
+            cout << "Failed to load mesh: " << e.what() << endl;
+            exit(1);
+        }
+    }
+    auto loaded = std::chrono::steady_clock::now();
+    scene.mesh_geometry.build();
+    auto built = std::chrono::steady_clock::now();
+
+    cout << "Loaded " << scene.mesh_geometry.num_triangles() << " mesh triangles in "
+         << std::chrono::duration<float>(loaded - start).count() << "s, BVH built in "
+         << std::chrono::duration<float>(built - loaded).count() << "s" << endl;
+}
+
+// Registered with atexit, so that renders stopped by an error are reported too
+void write_stats() {
+    try {
+        write_stats_report(options.stats_file, {
+            {"width", (double)scene.image_width}, {"height", (double)scene.image_height}, {"spp", (double)options.spp}, {"k", (double)options.k},
+            {"num_photons", (double)options.num_photons}, {"num_caustic_photons", (double)options.num_caustic_photons},
+            {"diffuse_photons_stored", (double)(diffuse_photons.size() + diffuse_store.size())},
+            {"caustic_photons_stored", (double)(caustic_photons.size() + caustic_store.size())}
+        });
+    } catch (const std::exception &e) {
+        cout << "Failed to write stats: " << e.what() << endl;
+        return;
+    }
+    cout << "Stats written to " << options.stats_file << endl;
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+    if (!options.stats_file.empty()) std::atexit(write_stats);
+    if (options.image_width > 0) {
+        // The scene's image plane is square, other aspect ratios widen or heighten it around the same view
+        CameraPose pose = scene_camera_pose();
+        scene.image_width = options.image_width;
+        scene.image_height = options.image_height;
+        if (options.image_width != options.image_height) look_at(pose);
+    }
+    if (options.seed != 0) random_seed = options.seed;
+
+    // A resumed render continues with the seed it started with, which also retraces the same photon maps
+    RenderCheckpoint checkpoint;
+    if (options.resume) {
+        try {
+            checkpoint.read(options.checkpoint_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to resume: " << e.what() << endl;
+            return 1;
+        }
+        random_seed = checkpoint.seed;
+        cout << "Resuming " << options.checkpoint_file << " at pass " << checkpoint.next_pass + 1 << ", row " << checkpoint.next_row << endl;
+    }
+    seed_random(random_seed);
+    if (options.serve_stdin) {
+        // Replies go to stdout, so the progress log moves to stderr
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    load_scene();
+
+    if (!options.compile_scene_file.empty()) {
+        try {
+            write_scene_file(options.compile_scene_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to compile scene: " << e.what() << endl;
+            return 1;
+        }
+        cout << "Compiled scene written to " << options.compile_scene_file << endl;
+        return 0;
+    }
+
+    if (!options.lightmap_file.empty()) {
+        try {
+            lightmaps.read(options.lightmap_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to load lightmap: " << e.what() << endl;
+            return 1;
+        }
+        cout << "Loaded " << lightmaps.texels.size() << " lightmap texels from " << options.lightmap_file << endl;
+    }
+
+    // Mesh triangles are not baked, so they still need the photon maps. A coordinator only traces them
+    // to fill the photon cache or store for its workers.
+    bool needs_photons = lightmaps.empty() || scene.mesh_geometry.num_triangles() > 0;
+    if (options.num_workers > 0 && options.photon_cache_file.empty() && options.photon_store_prefix.empty()) needs_photons = false;
+    // Visualizations run off the critical path, the futures join them when main returns. With
+    // --pipeline, photon mapping also runs alongside the direct lighting of the first render.
+    std::future<void> visualization;
+    std::future<void> photon_mapping;
+    auto build_photon_maps = [&visualization]() {
+        load_or_map_photons();
+
+        // The trees are independent, so the caustic tree is balanced on its own thread
+        std::future<void> caustic_build = std::async(std::launch::async, []() {
+            ScopedPhase phase("caustic_kd_build");
+            sort_photons_morton(caustic_photons);
+            caustic_kd = KDTree(&caustic_photons);
+            if (!caustic_photons.empty()) caustic_kd.balance();
+        });
+        {
+            ScopedPhase phase("diffuse_kd_build");
+            sort_photons_morton(diffuse_photons);
+            diffuse_kd = KDTree(&diffuse_photons);
+            if (!diffuse_photons.empty()) diffuse_kd.balance();
+        }
+        caustic_build.get();
+
+        // Workers share the coordinator's directory, so stdin servers leave the visualizations to it
+        if (!options.serve_stdin) {
+            visualization = std::async(std::launch::async, []() {
+                ScopedPhase phase("visualization");
+                visualize_photons(caustic_photons, caustic_kd, "caustic.png");
+                visualize_photons(diffuse_photons, diffuse_kd, "diffuse.png");
+            });
+        }
+
+        std::cout << "Photon Mapping Complete" << std::endl;
+    };
+    if (needs_photons) {
+        std::cout << "Starting Photon Mapping" << std::endl;
+        if (options.pipeline) {
+            // Photon emission draws from the calling thread's generator, seeded as main's was
+            photon_mapping = std::async(std::launch::async, [&build_photon_maps]() {
+                seed_random(random_seed);
+                build_photon_maps();
+            });
+        } else {
+            build_photon_maps();
+        }
+    }
+
+    if (!options.bake_lightmap_file.empty()) {
+        ScopedPhase phase("lightmap_bake");
+        auto start = std::chrono::steady_clock::now();
+        lightmaps.build_charts(options.lightmap_texel_size);
+        lightmaps.bake([](Vec3f p, const SceneElement &ele) {
+            return eval_indirect_lighting(p, ele.surface_index) + eval_caustic_lighting(p, ele.surface_index);
+        });
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+        try {
+            lightmaps.write(options.bake_lightmap_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to write lightmap: " << e.what() << endl;
+            return 1;
+        }
+        cout << "Baked " << lightmaps.texels.size() << " lightmap texels in " << elapsed.count() << "s to " << options.bake_lightmap_file << endl;
+        return 0;
+    }
+
+    if (options.serve_stdin || !options.serve_socket.empty()) {
+        RenderJob defaults{scene.image_width, scene.image_height, options.spp, scene_camera_pose(), ImageRegion{}};
+        auto render = [](ImageRegion region, int spp, auto band_done) {
+            ScopedPhase phase("rendering");
+            render_region(region, spp, 0, STREAM_BAND_HEIGHT, band_done);
+        };
+        try {
+            if (options.serve_stdin) {
+                serve_jobs(stdin, stdout, defaults, render);
+            } else {
+#ifdef _WIN32
+                throw std::runtime_error("Unix sockets are not available on this platform, use --serve");
+#else
+                serve_socket(options.serve_socket, defaults, render);
+#endif
+            }
+        } catch (const std::exception &e) {
+            cout << "Failed to serve: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<std::unique_ptr<WorkerProcess>> workers;
+    if (options.num_workers > 0) {
+        try {
+            workers = start_workers(argc, argv);
+        } catch (const std::exception &e) {
+            cout << "Failed to start workers: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    // Photon maps, kd-trees and the mesh BVH are view independent, so only the camera changes between frames
+    std::vector<CameraPose> poses;
+    if (!options.camera_path_file.empty()) {
+        try {
+            poses = load_camera_path(options.camera_path_file);
+        } catch (const std::exception &e) {
+            cout << "Failed to load camera path: " << e.what() << endl;
+            return 1;
+        }
+        if (options.num_frames > 0) poses = interpolate_camera_path(poses, options.num_frames);
+    }
+
+    ImageFormat format;
+    try {
+        format = image_format(options.output_file);
+    } catch (const std::exception &e) {
+        cout << "Invalid --output: " << e.what() << endl;
+        return 1;
+    }
+    std::string extension = options.output_file.substr(options.output_file.find_last_of('.'));
+
+    // The visualizations are drawn from the scene's camera, which the path moves
+    if (!poses.empty() && visualization.valid()) visualization.wait();
+
+    // PNG is written from the full framebuffer at the end, the scanline formats band by band (or tile
+    // by tile) as they finish
+    std::vector<Vec3f> pixels;
+    int num_frames = poses.empty() ? 1 : poses.size();
+    for (int frame = 0; frame < num_frames; frame++) {
+        auto frame_start = std::chrono::steady_clock::now();
+        const CameraPose* pose = poses.empty() ? nullptr : &poses[frame];
+        if (pose != nullptr) look_at(*pose);
+
+        char frame_name[32];
+        snprintf(frame_name, sizeof(frame_name), "frame_%04d", frame);
+        std::string filename = pose == nullptr ? options.output_file : frame_name + extension;
+        try {
+            std::unique_ptr<ScanlineImageFile> image;
+            if (format != PNG_FORMAT) image = std::make_unique<ScanlineImageFile>(filename, scene.image_width, scene.image_height, format);
+            // The denoiser and --pipeline need the whole frame, so they turn off streaming rows and tiles into
+            // image, and checkpointed renders accumulate the frame before writing it
+            bool streaming = image != nullptr && !options.denoise && !photon_mapping.valid() && options.checkpoint_file.empty();
+
+            if (options.diagnostics) pixel_diagnostics.assign(scene.image_width * scene.image_height, PixelDiagnostics());
+            std::vector<PixelFeatures> features;
+            if (options.denoise || options.write_aovs) {
+                ScopedPhase phase("features");
+                features = render_features(frame_region());
+                if (options.write_aovs) write_aovs(features, filename.substr(0, filename.find_last_of('.')));
+            }
+            auto write_output = [&]() {
+                if (options.denoise) {
+                    ScopedPhase phase("denoising");
+                    denoise_atrous(pixels, features, frame_region(), options.denoise_iterations);
+                }
+                ScopedPhase phase("output");
+                if (image != nullptr) {
+                    image->write_block(frame_region(), pixels.data());
+                } else {
+                    write_png(pixels, filename.c_str());
+                }
+            };
+
+            if (options.progressive) {
+                render_frame_progressive(pixels, write_output);
+            } else if (!workers.empty()) {
+                render_frame_on_workers(workers, pose, pixels, streaming ? image.get() : nullptr);
+            } else if (!options.checkpoint_file.empty()) {
+                if (!options.resume) {
+                    checkpoint.seed = random_seed;
+                    checkpoint.width = scene.image_width;
+                    checkpoint.height = scene.image_height;
+                    checkpoint.spp = options.spp;
+                    checkpoint.pass_spp = std::min(options.pass_spp, options.spp);
+                    checkpoint.radiance.assign(scene.image_width * scene.image_height, Vec3f{0.0f, 0.0f, 0.0f});
+                    checkpoint.samples.assign(scene.image_width * scene.image_height, 0);
+                } else if (checkpoint.width != scene.image_width || checkpoint.height != scene.image_height || checkpoint.spp != options.spp) {
+                    throw std::runtime_error(options.checkpoint_file + " is for a different resolution or sample count");
+                }
+                render_frame_in_passes(checkpoint, pixels);
+            } else if (photon_mapping.valid()) {
+                deferred_thread_gathers.assign(omp_get_max_threads(), {});
+                render_frame(pixels);
+                photon_mapping.get();
+                resolve_deferred_gathers(pixels);
+            } else if (streaming) {
+                render_frame_to_file(*image);
+            } else {
+                render_frame(pixels);
+            }
+            if (!options.progressive && !streaming) write_output();
+            if (options.diagnostics) write_diagnostics(filename.substr(0, filename.find_last_of('.')));
+            if (!options.checkpoint_file.empty()) std::remove(options.checkpoint_file.c_str());
+        } catch (const std::exception &e) {
+            cout << "Failed to render " << filename << ": " << e.what() << endl;
+            return 1;
+        }
+
+        if (pose != nullptr) {
+            cout << "Frame " << frame + 1 << "/" << poses.size() << " written to " << filename << " in "
+                 << std::chrono::duration<float>(std::chrono::steady_clock::now() - frame_start).count() << "s" << endl;
+        }
+    }
+    return 0;
+}
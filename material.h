@@ -1,3 +1,5 @@
+#pragma once
+
 #include "common.h"
 
 const uint8_t LAMBERTIAN = 0;
@@ -6,6 +8,7 @@ const uint8_t GLOSSY = 2;
 
 struct Surface {
     uint8_t type;
+    bool emitter = false; // Surface of a light, seen as white by camera rays
     Vec3f normal;
     Vec3f albedo;
 };
\ No newline at end of file
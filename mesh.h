@@ -0,0 +1,80 @@
+#pragma once
+
+#include "common.h"
+#include "bvh.h"
+
+// Read-only view of a contiguous array owned elsewhere
+template<typename T>
+struct Span {
+    const T* data = nullptr;
+    size_t count = 0;
+
+    Span() {}
+    Span(const T* given_data, size_t given_count) : data(given_data), count(given_count) {}
+    Span(const std::vector<T> &v) : data(v.data()), count(v.size()) {}
+    const T &operator[](size_t i) const { return data[i]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
+
+// Triangle range of the shared index buffer drawn with one surface
+struct Mesh {
+    uint32_t first_triangle;
+    uint32_t num_triangles;
+    int surface_index;
+};
+
+// All meshes of a scene share one vertex buffer, one index buffer (three indices per triangle)
+// and one BVH, so a triangle costs 12 bytes of indices instead of three copies of its vertices.
+// The spans are what the renderer reads; they point either at the buffers filled by add_mesh
+// and build, or straight into a mapped compiled scene file.
+struct MeshGeometry {
+    std::vector<Vec3f> vertex_buffer;
+    std::vector<uint32_t> index_buffer;
+    std::vector<Mesh> mesh_buffer;
+    std::vector<BVHNode> bvh_node_buffer;
+    std::vector<uint32_t> bvh_triangle_buffer;
+
+    Span<Vec3f> vertices;
+    Span<uint32_t> indices;
+    Span<Mesh> meshes;
+    Span<BVHNode> bvh_nodes;
+    Span<uint32_t> bvh_triangles;
+
+    uint32_t num_triangles() const;
+    void add_mesh(const std::vector<Vec3f> &mesh_vertices, const std::vector<uint32_t> &mesh_indices, int surface_index);
+    void build();
+    const Mesh &mesh_of(uint32_t triangle) const;
+};
+
+uint32_t MeshGeometry::num_triangles() const {
+    return indices.size() / 3;
+}
+
+void MeshGeometry::add_mesh(const std::vector<Vec3f> &mesh_vertices, const std::vector<uint32_t> &mesh_indices, int surface_index) {
+    uint32_t base_vertex = vertex_buffer.size();
+    mesh_buffer.push_back(Mesh{(uint32_t)(index_buffer.size() / 3), (uint32_t)(mesh_indices.size() / 3), surface_index});
+    vertex_buffer.insert(vertex_buffer.end(), mesh_vertices.begin(), mesh_vertices.end());
+    index_buffer.reserve(index_buffer.size() + mesh_indices.size());
+    for (uint32_t index : mesh_indices) {
+        index_buffer.push_back(base_vertex + index);
+    }
+}
+
+void MeshGeometry::build() {
+    build_bvh(vertex_buffer.data(), index_buffer.data(), index_buffer.size() / 3, bvh_node_buffer, bvh_triangle_buffer);
+    vertices = vertex_buffer;
+    indices = index_buffer;
+    meshes = mesh_buffer;
+    bvh_nodes = bvh_node_buffer;
+    bvh_triangles = bvh_triangle_buffer;
+}
+
+const Mesh &MeshGeometry::mesh_of(uint32_t triangle) const {
+    auto it = std::upper_bound(meshes.begin(), meshes.end(), triangle, [](uint32_t tri, const Mesh &mesh) {
+        return tri < mesh.first_triangle;
+    });
+    return *(it - 1);
+}
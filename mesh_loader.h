@@ -0,0 +1,276 @@
+#pragma once
+
+#include <charconv>
+#include <stdexcept>
+#include <cstring>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "scene.h"
+
+// Read-only view of a whole file, memory-mapped where the platform allows it
+class MappedFile {
+    public:
+        const char* data = nullptr;
+        size_t size = 0;
+        MappedFile(const std::string &path);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+    private:
+#ifdef _WIN32
+        std::vector<char> buffer;
+#endif
+};
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot open " + path);
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    data = buffer.data();
+    size = buffer.size();
+}
+
+MappedFile::~MappedFile() {}
+#else
+MappedFile::MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("cannot stat " + path);
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("cannot map " + path);
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = (const char*)mapping;
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) munmap((void*)data, size);
+}
+#endif
+
+const char* skip_spaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+const char* next_line(const char* p, const char* end) {
+    p = (const char*)memchr(p, '\n', end - p);
+    return p == nullptr ? end : p + 1;
+}
+
+// Positions and faces of a Wavefront OBJ file; polygons are split into triangle fans and
+// texture coordinates, normals, groups and materials are ignored
+void load_obj(const std::string &path, std::vector<Vec3f> &vertices, std::vector<uint32_t> &indices) {
+    MappedFile file(path);
+    const char* end = file.data + file.size;
+    std::vector<uint32_t> polygon;
+
+    for (const char* p = file.data; p < end; p = next_line(p, end)) {
+        p = skip_spaces(p, end);
+        if (end - p < 2 || (p[1] != ' ' && p[1] != '\t')) continue;
+
+        if (p[0] == 'v') {
+            Vec3f v;
+            p += 2;
+            for (int i = 0; i < 3; i++) {
+                p = skip_spaces(p, end);
+                auto [next, error] = std::from_chars(p, end, v[i]);
+                if (error != std::errc()) throw std::runtime_error(path + ": malformed vertex");
+                p = next;
+            }
+            vertices.push_back(v);
+        } else if (p[0] == 'f') {
+            polygon.clear();
+            p = skip_spaces(p + 2, end);
+            while (p < end && *p != '\n') {
+                long index;
+                auto [next, error] = std::from_chars(p, end, index);
+                if (error != std::errc()) throw std::runtime_error(path + ": malformed face");
+                index = index < 0 ? (long)vertices.size() + index : index - 1;
+                if (index < 0 || index >= (long)vertices.size()) throw std::runtime_error(path + ": face index out of range");
+                polygon.push_back(index);
+                p = next;
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++; // Skip /vt/vn
+                p = skip_spaces(p, end);
+            }
+            for (int i = 2; i < (int)polygon.size(); i++) {
+                indices.insert(indices.end(), {polygon[0], polygon[i - 1], polygon[i]});
+            }
+        }
+    }
+}
+
+struct PlyProperty {
+    std::string name;
+    int size = 0;
+    char kind = 'f';
+    bool list = false;
+    int count_size = 0;
+    char count_kind = 'u';
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+// Size in bytes and kind (signed 'i', unsigned 'u' or floating 'f') of a PLY scalar type
+void ply_type(const std::string &type, int &size, char &kind) {
+    static const std::map<std::string, std::pair<int, char>> types = {
+        {"char", {1, 'i'}}, {"int8", {1, 'i'}}, {"uchar", {1, 'u'}}, {"uint8", {1, 'u'}},
+        {"short", {2, 'i'}}, {"int16", {2, 'i'}}, {"ushort", {2, 'u'}}, {"uint16", {2, 'u'}},
+        {"int", {4, 'i'}}, {"int32", {4, 'i'}}, {"uint", {4, 'u'}}, {"uint32", {4, 'u'}},
+        {"float", {4, 'f'}}, {"float32", {4, 'f'}}, {"double", {8, 'f'}}, {"float64", {8, 'f'}},
+    };
+    auto it = types.find(type);
+    if (it == types.end()) throw std::runtime_error("unknown PLY type " + type);
+    std::tie(size, kind) = it->second;
+}
+
+double read_ply_value(const char* p, int size, char kind, bool swap) {
+    unsigned char bytes[8];
+    memcpy(bytes, p, size);
+    if (swap) std::reverse(bytes, bytes + size);
+    switch (size * 16 + kind) {
+        case 1 * 16 + 'i': return *(int8_t*)bytes;
+        case 1 * 16 + 'u': return *(uint8_t*)bytes;
+        case 2 * 16 + 'i': { int16_t v; memcpy(&v, bytes, 2); return v; }
+        case 2 * 16 + 'u': { uint16_t v; memcpy(&v, bytes, 2); return v; }
+        case 4 * 16 + 'i': { int32_t v; memcpy(&v, bytes, 4); return v; }
+        case 4 * 16 + 'u': { uint32_t v; memcpy(&v, bytes, 4); return v; }
+        case 4 * 16 + 'f': { float v; memcpy(&v, bytes, 4); return v; }
+        default: { double v; memcpy(&v, bytes, 8); return v; }
+    }
+}
+
+// Vertex positions and faces of a binary (little or big endian) PLY file
+void load_ply(const std::string &path, std::vector<Vec3f> &vertices, std::vector<uint32_t> &indices) {
+    MappedFile file(path);
+    const char* end = file.data + file.size;
+    if (file.size < 4 || memcmp(file.data, "ply", 3) != 0) throw std::runtime_error(path + ": not a PLY file");
+
+    std::vector<PlyElement> elements;
+    bool swap = false;
+    const char* p = next_line(file.data, end);
+    for (;;) {
+        if (p >= end) throw std::runtime_error(path + ": missing end_header");
+        const char* line_end = next_line(p, end);
+        std::istringstream line(std::string(p, line_end));
+        p = line_end;
+
+        std::string keyword;
+        line >> keyword;
+        if (keyword == "end_header") break;
+        if (keyword == "format") {
+            std::string format;
+            line >> format;
+            if (format == "ascii") throw std::runtime_error(path + ": ASCII PLY is not supported, convert it to binary");
+            uint16_t probe = 1;
+            bool little_endian_host = *(uint8_t*)&probe == 1;
+            swap = (format == "binary_little_endian") != little_endian_host;
+        } else if (keyword == "element") {
+            PlyElement element;
+            line >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (keyword == "property" && !elements.empty()) {
+            PlyProperty property;
+            std::string type;
+            line >> type;
+            if (type == "list") {
+                std::string count_type, item_type;
+                line >> count_type >> item_type;
+                property.list = true;
+                ply_type(count_type, property.count_size, property.count_kind);
+                ply_type(item_type, property.size, property.kind);
+            } else {
+                ply_type(type, property.size, property.kind);
+            }
+            line >> property.name;
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    std::vector<uint32_t> polygon;
+    for (const PlyElement &element : elements) {
+        bool is_vertex = element.name == "vertex";
+        bool is_face = element.name == "face";
+        size_t base_vertex = vertices.size();
+        if (is_vertex) vertices.reserve(base_vertex + element.count);
+        if (is_face) indices.reserve(indices.size() + 3 * element.count);
+
+        for (size_t n = 0; n < element.count; n++) {
+            Vec3f v{0, 0, 0};
+            for (const PlyProperty &property : element.properties) {
+                if (property.list) {
+                    if (p + property.count_size > end) throw std::runtime_error(path + ": truncated");
+                    size_t count = read_ply_value(p, property.count_size, property.count_kind, swap);
+                    p += property.count_size;
+                    if (p + count * property.size > end) throw std::runtime_error(path + ": truncated");
+                    if (is_face && (property.name == "vertex_indices" || property.name == "vertex_index")) {
+                        polygon.clear();
+                        for (size_t i = 0; i < count; i++) {
+                            polygon.push_back(read_ply_value(p + i * property.size, property.size, property.kind, swap));
+                        }
+                        for (size_t i = 2; i < count; i++) {
+                            indices.insert(indices.end(), {polygon[0], polygon[i - 1], polygon[i]});
+                        }
+                    }
+                    p += count * property.size;
+                } else {
+                    if (p + property.size > end) throw std::runtime_error(path + ": truncated");
+                    if (is_vertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z') {
+                        v[property.name[0] - 'x'] = read_ply_value(p, property.size, property.kind, swap);
+                    }
+                    p += property.size;
+                }
+            }
+            if (is_vertex) vertices.push_back(v);
+        }
+    }
+
+    for (uint32_t index : indices) {
+        if (index >= vertices.size()) throw std::runtime_error(path + ": face index out of range");
+    }
+}
+
+// Loads an OBJ or PLY mesh, places it with a uniform scale and offset, and binds it to a new
+// surface appended to scene.surfaces. The mesh BVH must be rebuilt once all meshes are added.
+void add_mesh_file(const std::string &path, Surface mesh_surface, float scale, Vec3f offset) {
+    std::vector<Vec3f> vertices;
+    std::vector<uint32_t> indices;
+    std::string extension = path.substr(path.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "obj") {
+        load_obj(path, vertices, indices);
+    } else if (extension == "ply") {
+        load_ply(path, vertices, indices);
+    } else {
+        throw std::runtime_error(path + ": unsupported mesh format, expected .obj or .ply");
+    }
+
+    if (indices.empty()) throw std::runtime_error(path + ": mesh has no faces");
+
+    for (Vec3f &v : vertices) v = scale * v + offset;
+    scene.surfaces.push_back(mesh_surface);
+    scene.mesh_geometry.add_mesh(vertices, indices, scene.surfaces.size() - 1);
+}
@@ -0,0 +1,427 @@
+#pragma once
+
+#include "common.h"
+
+enum EmissionMode { UNIFORM_EMISSION, IMPORTANCE_EMISSION };
+enum PhotonBudgetMode { EMITTED_BUDGET, STORED_BUDGET };
+enum PhotonSort { NO_PHOTON_SORT, DIRECTION_PHOTON_SORT, ORIGIN_PHOTON_SORT };
+
+// Mesh file added to the scene, with its material and placement
+struct MeshSpec {
+    std::string path;
+    bool caustic = false;
+    Vec3f albedo{0.8f, 0.8f, 0.8f};
+    float scale = 1;
+    Vec3f offset{0, 0, 0};
+};
+
+// Area light added to the scene, the parallelogram or triangle spanned by edge_u and edge_v from corner
+struct LightSpec {
+    bool triangle = false;
+    Vec3f corner;
+    Vec3f edge_u;
+    Vec3f edge_v;
+    float power = 1;
+};
+
+struct Options {
+    int image_width = 0; // 0 keeps the scene's resolution
+    int image_height = 0;
+    int spp = 1024;
+    int k = 500;
+    long num_photons = 100000;
+    long num_caustic_photons = 100000;
+    EmissionMode emission_mode = UNIFORM_EMISSION;
+    PhotonBudgetMode photon_budget_mode = EMITTED_BUDGET;
+    long diffuse_target = 100000;
+    long caustic_target = 100000;
+    long photon_memory_mb = 1024;
+    int max_photon_depth = 64;
+    int photon_batch_size = 65536;
+    PhotonSort photon_sort = DIRECTION_PHOTON_SORT;
+    std::vector<MeshSpec> meshes;
+    float light_power = 1; // Power of the scene's ceiling light
+    std::vector<LightSpec> lights;
+    std::string scene_file;
+    std::string compile_scene_file;
+    std::string bake_lightmap_file;
+    std::string lightmap_file;
+    float lightmap_texel_size = 0.004f;
+    std::string camera_path_file;
+    int num_frames = 0;
+    bool serve_stdin = false;
+    std::string serve_socket;
+    int num_workers = 0;
+    long seed = 0;
+    std::string photon_cache_file;
+    std::string photon_store_prefix;
+    int photon_brick_grid = 8;
+    long photon_store_cache_mb = 1024;
+    std::string output_file = "output.png";
+    std::string checkpoint_file;
+    float checkpoint_interval = 300;
+    bool resume = false;
+    int pass_spp = 64;
+    bool progressive = false;
+    float time_budget = 0;
+    float noise_target = 0;
+    bool denoise = false;
+    int denoise_iterations = 5;
+    bool write_aovs = false;
+    bool diagnostics = false;
+    bool pipeline = false;
+    std::string stats_file;
+};
+
+Options options;
+
+void print_usage(char const * program) {
+    cout << "Usage: " << program << " [options]" << endl;
+    cout << "  --resolution W,H                image size in pixels (default 1024,1024)" << endl;
+    cout << "  --spp N                         samples per pixel (default 1024)" << endl;
+    cout << "  --k N                           photons per radiance estimate (default 500)" << endl;
+    cout << "  --photons N                     photons emitted by the global pass (default 100000)" << endl;
+    cout << "  --caustic-photons N             photons emitted through the projection map (default 100000)" << endl;
+    cout << "  --emission uniform|importance   photon emission distribution (default uniform)" << endl;
+    cout << "  --photon-budget emitted|stored  stop after a fixed number of emitted photons, or once" << endl;
+    cout << "                                  the photon maps hold their target counts (default emitted)" << endl;
+    cout << "  --diffuse-target N              stored diffuse photons in stored budget mode" << endl;
+    cout << "  --caustic-target N              stored caustic photons in stored budget mode" << endl;
+    cout << "  --photon-memory MB              hard cap on photon map storage (default 1024)" << endl;
+    cout << "  --max-photon-depth N            bounces before a photon path is cut (default 64)" << endl;
+    cout << "  --photon-batch N                photons traced together per bounce generation, 1 traces" << endl;
+    cout << "                                  one path at a time (default 65536)" << endl;
+    cout << "  --photon-sort none|direction|origin" << endl;
+    cout << "                                  ordering of each batch generation (default direction)" << endl;
+    cout << "  --mesh FILE                     add an OBJ or binary PLY mesh to the scene; the options" << endl;
+    cout << "                                  below apply to the most recently added mesh" << endl;
+    cout << "  --mesh-material lambertian|caustic" << endl;
+    cout << "  --mesh-albedo R,G,B" << endl;
+    cout << "  --mesh-transform S,X,Y,Z        uniform scale followed by an offset" << endl;
+    cout << "  --light X,Y,Z,UX,UY,UZ,VX,VY,VZ add an area light at corner X,Y,Z spanned by the two edges;" << endl;
+    cout << "                                  it emits on the side of their cross product" << endl;
+    cout << "  --light-shape quad|triangle     shape of the most recently added light (default quad)" << endl;
+    cout << "  --light-power P                 power of the most recently added light, or of the ceiling" << endl;
+    cout << "                                  light before any --light (default 1)" << endl;
+    cout << "  --compile-scene FILE            write the scene, its meshes and their BVH to FILE and exit" << endl;
+    cout << "  --scene FILE                    render a scene written by --compile-scene" << endl;
+    cout << "  --bake-lightmap FILE            bake indirect and caustic lighting of the static surfaces" << endl;
+    cout << "                                  to FILE and exit" << endl;
+    cout << "  --lightmap FILE                 render with a baked lightmap instead of photon map lookups" << endl;
+    cout << "  --lightmap-texel SIZE           lightmap texel size in scene units (default 0.004)" << endl;
+    cout << "  --camera-path FILE              render one frame per camera pose in FILE, reusing the photon maps" << endl;
+    cout << "  --frames N                      interpolate the camera path poses as keyframes over N frames" << endl;
+    cout << "  --serve                         keep the scene and photon maps loaded and answer render jobs" << endl;
+    cout << "                                  read from stdin, streaming the pixels to stdout" << endl;
+    cout << "  --serve-socket PATH             answer render jobs from clients of a Unix socket at PATH" << endl;
+    cout << "  --output FILE                   image to write, .png (default output.png), or .ppm, .pfm and .exr" << endl;
+    cout << "                                  written band by band as the render progresses" << endl;
+    cout << "  --checkpoint FILE               render in passes and save the progress to FILE periodically" << endl;
+    cout << "  --checkpoint-interval SECONDS   time between checkpoint writes (default 300)" << endl;
+    cout << "  --resume                        continue the render saved in the --checkpoint file" << endl;
+    cout << "  --pass-spp N                    samples per pixel in each pass of a checkpointed render (default 64)" << endl;
+    cout << "  --progressive                   render passes of 1, 1, 2, 2, 4, 4, ... spp up to --spp, rewriting the" << endl;
+    cout << "                                  output after each pass" << endl;
+    cout << "  --time-budget SECONDS           progressive: stop before a pass that would end past the budget" << endl;
+    cout << "  --noise-target N                progressive: stop once the estimated relative noise is below N" << endl;
+    cout << "  --denoise                       filter the image with an edge-aware a-trous filter guided by" << endl;
+    cout << "                                  first-hit albedo, normal, depth and surface before writing it" << endl;
+    cout << "  --denoise-iterations N          filter iterations, each doubling the footprint (default 5)" << endl;
+    cout << "  --aovs                          also write the albedo, normal, depth and surface buffers as PFM" << endl;
+    cout << "  --diagnostics                   also write per-pixel render time, kd-tree nodes visited, gather radius," << endl;
+    cout << "                                  photons found and caustic depth as PFM, and a render time heatmap" << endl;
+    cout << "  --pipeline                      render direct lighting while the photon maps are traced and built," << endl;
+    cout << "                                  then add the photon gathers" << endl;
+    cout << "  --workers N                     render tiles on N worker processes and merge them" << endl;
+    cout << "  --seed N                        random seed, the same seed traces the same photon maps" << endl;
+    cout << "  --photon-cache FILE             load the photon maps from FILE, or trace and save them there" << endl;
+    cout << "  --photon-store PREFIX           keep the photon maps on disk in PREFIX_diffuse.bricks and PREFIX_caustic.bricks," << endl;
+    cout << "                                  tracing them there when they do not exist yet" << endl;
+    cout << "  --photon-brick-grid N           cells along each axis of a new photon store (default 8)" << endl;
+    cout << "  --photon-store-cache MB         memory for photon store bricks paged in by gathers (default 1024)" << endl;
+    cout << "  --stats FILE                    write phase times and ray, primitive and photon gather counts to" << endl;
+    cout << "                                  FILE as JSON at exit" << endl;
+}
+
+// Positive integer of at most max, which defaults to the range of the int options
+long parse_count(char const * program, const std::string &arg, const std::string &value, long max = INT_MAX) {
+    try {
+        size_t end;
+        long count = std::stol(value, &end);
+        if (end == value.size() && count > 0 && count <= max) return count;
+    } catch (const std::exception &) {}
+    cout << "Invalid value for " << arg << ": '" << value << "'" << endl;
+    print_usage(program);
+    exit(1);
+}
+
+std::vector<float> parse_floats(char const * program, const std::string &arg, const std::string &value, int count) {
+    std::vector<float> floats;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        try {
+            size_t end;
+            floats.push_back(std::stof(item, &end));
+            if (end != item.size()) floats.clear();
+        } catch (const std::exception &) {
+            break;
+        }
+    }
+    if ((int)floats.size() == count) return floats;
+    cout << "Invalid value for " << arg << ": '" << value << "', expected " << count << " comma separated numbers" << endl;
+    print_usage(program);
+    exit(1);
+}
+
+LightSpec &last_light(char const * program, const std::string &arg) {
+    if (options.lights.empty()) {
+        cout << arg << " must follow --light" << endl;
+        print_usage(program);
+        exit(1);
+    }
+    return options.lights.back();
+}
+
+MeshSpec &last_mesh(char const * program, const std::string &arg) {
+    if (options.meshes.empty()) {
+        cout << arg << " must follow --mesh" << endl;
+        print_usage(program);
+        exit(1);
+    }
+    return options.meshes.back();
+}
+
+void parse_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+
+        if (arg == "--resolution") {
+            size_t comma = value.find(',');
+            options.image_width = parse_count(argv[0], arg, value.substr(0, comma));
+            options.image_height = parse_count(argv[0], arg, comma == std::string::npos ? "" : value.substr(comma + 1));
+            i++;
+        } else if (arg == "--spp") {
+            options.spp = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--k") {
+            options.k = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--photons") {
+            options.num_photons = parse_count(argv[0], arg, value, LONG_MAX);
+            i++;
+        } else if (arg == "--caustic-photons") {
+            options.num_caustic_photons = parse_count(argv[0], arg, value, LONG_MAX);
+            i++;
+        } else if (arg == "--emission" && (value == "uniform" || value == "importance")) {
+            options.emission_mode = value == "uniform" ? UNIFORM_EMISSION : IMPORTANCE_EMISSION;
+            i++;
+        } else if (arg == "--photon-budget" && (value == "emitted" || value == "stored")) {
+            options.photon_budget_mode = value == "emitted" ? EMITTED_BUDGET : STORED_BUDGET;
+            i++;
+        } else if (arg == "--diffuse-target") {
+            options.diffuse_target = parse_count(argv[0], arg, value, LONG_MAX);
+            i++;
+        } else if (arg == "--caustic-target") {
+            options.caustic_target = parse_count(argv[0], arg, value, LONG_MAX);
+            i++;
+        } else if (arg == "--photon-memory") {
+            options.photon_memory_mb = parse_count(argv[0], arg, value, LONG_MAX >> 20);
+            i++;
+        } else if (arg == "--max-photon-depth") {
+            options.max_photon_depth = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--photon-batch") {
+            options.photon_batch_size = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--photon-sort" && (value == "none" || value == "direction" || value == "origin")) {
+            options.photon_sort = value == "none" ? NO_PHOTON_SORT : value == "direction" ? DIRECTION_PHOTON_SORT : ORIGIN_PHOTON_SORT;
+            i++;
+        } else if (arg == "--mesh" && !value.empty()) {
+            options.meshes.push_back(MeshSpec{.path = value});
+            i++;
+        } else if (arg == "--mesh-material" && (value == "lambertian" || value == "caustic")) {
+            last_mesh(argv[0], arg).caustic = value == "caustic";
+            i++;
+        } else if (arg == "--mesh-albedo") {
+            std::vector<float> albedo = parse_floats(argv[0], arg, value, 3);
+            last_mesh(argv[0], arg).albedo = Vec3f{albedo[0], albedo[1], albedo[2]};
+            i++;
+        } else if (arg == "--mesh-transform") {
+            std::vector<float> transform = parse_floats(argv[0], arg, value, 4);
+            last_mesh(argv[0], arg).scale = transform[0];
+            last_mesh(argv[0], arg).offset = Vec3f{transform[1], transform[2], transform[3]};
+            i++;
+        } else if (arg == "--light") {
+            std::vector<float> light = parse_floats(argv[0], arg, value, 9);
+            options.lights.push_back(LightSpec{
+                .corner = Vec3f{light[0], light[1], light[2]},
+                .edge_u = Vec3f{light[3], light[4], light[5]},
+                .edge_v = Vec3f{light[6], light[7], light[8]}
+            });
+            i++;
+        } else if (arg == "--light-shape" && (value == "quad" || value == "triangle")) {
+            last_light(argv[0], arg).triangle = value == "triangle";
+            i++;
+        } else if (arg == "--light-power") {
+            float power = parse_floats(argv[0], arg, value, 1)[0];
+            (options.lights.empty() ? options.light_power : options.lights.back().power) = power;
+            i++;
+        } else if (arg == "--compile-scene" && !value.empty()) {
+            options.compile_scene_file = value;
+            i++;
+        } else if (arg == "--scene" && !value.empty()) {
+            options.scene_file = value;
+            i++;
+        } else if (arg == "--bake-lightmap" && !value.empty()) {
+            options.bake_lightmap_file = value;
+            i++;
+        } else if (arg == "--lightmap" && !value.empty()) {
+            options.lightmap_file = value;
+            i++;
+        } else if (arg == "--lightmap-texel") {
+            options.lightmap_texel_size = parse_floats(argv[0], arg, value, 1)[0];
+            i++;
+        } else if (arg == "--camera-path" && !value.empty()) {
+            options.camera_path_file = value;
+            i++;
+        } else if (arg == "--frames") {
+            options.num_frames = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--serve") {
+            options.serve_stdin = true;
+        } else if (arg == "--serve-socket" && !value.empty()) {
+            options.serve_socket = value;
+            i++;
+        } else if (arg == "--output" && value.find('.') != std::string::npos) {
+            options.output_file = value;
+            i++;
+        } else if (arg == "--checkpoint" && !value.empty()) {
+            options.checkpoint_file = value;
+            i++;
+        } else if (arg == "--checkpoint-interval") {
+            options.checkpoint_interval = parse_floats(argv[0], arg, value, 1)[0];
+            i++;
+        } else if (arg == "--resume") {
+            options.resume = true;
+        } else if (arg == "--pass-spp") {
+            options.pass_spp = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--progressive") {
+            options.progressive = true;
+        } else if (arg == "--time-budget") {
+            options.time_budget = parse_floats(argv[0], arg, value, 1)[0];
+            options.progressive = true;
+            i++;
+        } else if (arg == "--noise-target") {
+            options.noise_target = parse_floats(argv[0], arg, value, 1)[0];
+            options.progressive = true;
+            i++;
+        } else if (arg == "--denoise") {
+            options.denoise = true;
+        } else if (arg == "--denoise-iterations") {
+            options.denoise_iterations = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--aovs") {
+            options.write_aovs = true;
+        } else if (arg == "--diagnostics") {
+            options.diagnostics = true;
+        } else if (arg == "--pipeline") {
+            options.pipeline = true;
+        } else if (arg == "--workers") {
+            options.num_workers = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--seed") {
+            options.seed = parse_count(argv[0], arg, value, LONG_MAX);
+            i++;
+        } else if (arg == "--photon-cache" && !value.empty()) {
+            options.photon_cache_file = value;
+            i++;
+        } else if (arg == "--photon-store" && !value.empty()) {
+            options.photon_store_prefix = value;
+            i++;
+        } else if (arg == "--photon-brick-grid") {
+            options.photon_brick_grid = parse_count(argv[0], arg, value);
+            i++;
+        } else if (arg == "--photon-store-cache") {
+            options.photon_store_cache_mb = parse_count(argv[0], arg, value, LONG_MAX >> 20);
+            i++;
+        } else if (arg == "--stats" && !value.empty()) {
+            options.stats_file = value;
+            i++;
+        } else {
+            print_usage(argv[0]);
+            exit(arg == "--help" ? 0 : 1);
+        }
+    }
+
+    if (!options.scene_file.empty() && !options.meshes.empty()) {
+        cout << "--mesh cannot be combined with --scene, compile the meshes into the scene instead" << endl;
+        exit(1);
+    }
+    if (!options.scene_file.empty() && (!options.lights.empty() || options.light_power != 1)) {
+        cout << "--light and --light-power cannot be combined with --scene, compile the lights into the scene instead" << endl;
+        exit(1);
+    }
+    float total_power = options.light_power;
+    bool negative_power = options.light_power < 0;
+    for (const LightSpec &light : options.lights) {
+        if (!(length2(cross(light.edge_u, light.edge_v)) > 0)) {
+            cout << "--light needs two edges that are not parallel" << endl;
+            exit(1);
+        }
+        total_power += light.power;
+        negative_power = negative_power || light.power < 0;
+    }
+    if (negative_power || !(total_power > 0)) {
+        cout << "Light powers must be non-negative and not all zero" << endl;
+        exit(1);
+    }
+    if (options.serve_stdin && !options.serve_socket.empty()) {
+        cout << "--serve and --serve-socket are exclusive" << endl;
+        exit(1);
+    }
+    if (options.num_workers > 0 && (options.serve_stdin || !options.serve_socket.empty() ||
+                                    !options.bake_lightmap_file.empty() || !options.compile_scene_file.empty())) {
+        cout << "--workers only renders images, it cannot be combined with --serve, --serve-socket, --bake-lightmap or --compile-scene" << endl;
+        exit(1);
+    }
+    if (options.progressive && (!options.checkpoint_file.empty() || options.num_workers > 0 || !options.camera_path_file.empty() ||
+                                options.serve_stdin || !options.serve_socket.empty())) {
+        cout << "--progressive renders a single frame locally, it cannot be combined with --checkpoint, --workers, --camera-path or serving" << endl;
+        exit(1);
+    }
+    if (options.resume && options.checkpoint_file.empty()) {
+        cout << "--resume needs the --checkpoint file to continue from" << endl;
+        exit(1);
+    }
+    if (!options.checkpoint_file.empty() && (options.num_workers > 0 || !options.camera_path_file.empty() ||
+                                             options.serve_stdin || !options.serve_socket.empty())) {
+        cout << "--checkpoint renders a single frame locally, it cannot be combined with --workers, --camera-path or serving" << endl;
+        exit(1);
+    }
+    if (options.diagnostics && (options.num_workers > 0 || options.serve_stdin || !options.serve_socket.empty())) {
+        cout << "--diagnostics measures pixels rendered locally, it cannot be combined with --workers or serving" << endl;
+        exit(1);
+    }
+    if (options.pipeline && (options.progressive || !options.checkpoint_file.empty() || options.num_workers > 0 ||
+                             !options.camera_path_file.empty() || !options.bake_lightmap_file.empty() || options.diagnostics ||
+                             options.serve_stdin || !options.serve_socket.empty())) {
+        cout << "--pipeline overlaps photon mapping with a single local render, it cannot be combined with --progressive," << endl;
+        cout << "--checkpoint, --workers, --camera-path, --bake-lightmap, --diagnostics or serving" << endl;
+        exit(1);
+    }
+    if (options.photon_brick_grid > 64) {
+        cout << "--photon-brick-grid is at most 64" << endl;
+        exit(1);
+    }
+    if (!options.photon_store_prefix.empty() && !options.photon_cache_file.empty()) {
+        cout << "--photon-store and --photon-cache are exclusive" << endl;
+        exit(1);
+    }
+    if (options.num_frames > 0 && options.camera_path_file.empty()) {
+        cout << "--frames needs a --camera-path to interpolate" << endl;
+        exit(1);
+    }
+}
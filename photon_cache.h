@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+
+#include "common.h"
+#include "scene.h"
+
+const char PHOTON_CACHE_MAGIC[8] = {'P', 'M', 'P', 'H', 'O', 'T', 'O', 'N'};
+const uint32_t PHOTON_CACHE_VERSION = 1;
+
+// Normalized diffuse and caustic photon maps of one scene, so that several processes can render
+// from the same maps without each tracing them
+struct PhotonCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t photon_stride;
+    uint32_t num_surfaces;
+    uint32_t num_elements;
+    uint64_t num_diffuse;
+    uint64_t num_caustic;
+};
+
+void write_photon_cache(const std::string &path, const std::vector<Photon> &diffuse, const std::vector<Photon> &caustic) {
+    PhotonCacheHeader header = {};
+    memcpy(header.magic, PHOTON_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PHOTON_CACHE_VERSION;
+    header.photon_stride = sizeof(Photon);
+    header.num_surfaces = scene.surfaces.size();
+    header.num_elements = scene.scene_elements.size();
+    header.num_diffuse = diffuse.size();
+    header.num_caustic = caustic.size();
+
+    // Write to a temporary name first so that a concurrent reader never sees a partial cache
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file) throw std::runtime_error("cannot create " + temporary);
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)diffuse.data(), diffuse.size() * sizeof(Photon));
+        file.write((const char*)caustic.data(), caustic.size() * sizeof(Photon));
+        if (!file) throw std::runtime_error("failed writing " + temporary);
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) throw std::runtime_error("cannot rename " + temporary + " to " + path);
+}
+
+// Returns false when there is no cache at path yet
+bool read_photon_cache(const std::string &path, std::vector<Photon> &diffuse, std::vector<Photon> &caustic) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    PhotonCacheHeader header;
+    file.read((char*)&header, sizeof(header));
+    if (!file || memcmp(header.magic, PHOTON_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != PHOTON_CACHE_VERSION) {
+        throw std::runtime_error(path + ": not a photon cache");
+    }
+    if (header.photon_stride != sizeof(Photon)) throw std::runtime_error(path + ": written by a build with a different photon layout");
+    if (header.num_surfaces != scene.surfaces.size() || header.num_elements != scene.scene_elements.size()) {
+        throw std::runtime_error(path + ": traced for a different scene");
+    }
+
+    file.seekg(0, std::ios::end);
+    if ((uint64_t)file.tellg() != sizeof(header) + (header.num_diffuse + header.num_caustic) * sizeof(Photon)) {
+        throw std::runtime_error(path + ": truncated photon cache");
+    }
+    file.seekg(sizeof(header));
+    diffuse.resize(header.num_diffuse);
+    caustic.resize(header.num_caustic);
+    file.read((char*)diffuse.data(), diffuse.size() * sizeof(Photon));
+    file.read((char*)caustic.data(), caustic.size() * sizeof(Photon));
+    if (!file) throw std::runtime_error("failed reading " + path);
+    return true;
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "common.h"
+#include "scene.h"
+#include "raytracer.h"
+#include "projection.h"
+#include "importance.h"
+#include "options.h"
+#include "photon_store.h"
+#include "stats.h"
+
+const bool USE_PROJECTION_MAP = true;
+const int PROJECTION_MAP_RESOLUTION = 64;
+const int PROJECTION_MAP_PATCHES = 4;
+const int NUM_IMPORTONS = 100000;
+const int IMPORTANCE_PATCHES = 4;
+const int IMPORTANCE_RESOLUTION = 16;
+const int IMPORTANCE_PILOTS = 4;
+const int IMPORTANCE_K = 16;
+const int MAX_EMITTED_PER_TARGET = 100;
+
+std::vector<Photon> diffuse_photons;
+std::vector<Photon> caustic_photons;
+
+// Storage limits of the photon maps, and the number of photons emitted while each map still
+// accepted deposits. Stored powers are normalized by the latter once emission is done. With
+// --photon-store, deposits are handed to the brick writers after every batch.
+struct PhotonBudget {
+    size_t diffuse_capacity = SIZE_MAX;
+    size_t caustic_capacity = SIZE_MAX;
+    long diffuse_emitted = 0;
+    long caustic_emitted = 0;
+    size_t diffuse_spilled = 0;
+    size_t caustic_spilled = 0;
+    size_t diffuse_rejected = 0; // Deposits turned away from a full map
+    size_t caustic_rejected = 0;
+};
+
+PhotonBudget photon_budget;
+std::unique_ptr<PhotonBrickWriter> diffuse_brick_writer;
+std::unique_ptr<PhotonBrickWriter> caustic_brick_writer;
+
+size_t diffuse_stored() { return diffuse_photons.size() + photon_budget.diffuse_spilled; }
+size_t caustic_stored() { return caustic_photons.size() + photon_budget.caustic_spilled; }
+
+// Deposits the photon at the hit and moves it to its next bounce. Returns false once the path ends.
+// With caustic_pass set, the photon was emitted through the projection map: only its first
+// diffuse hit after a specular bounce is stored, everything else is covered by the global pass
+template<uint8_t MATERIAL>
+bool photon_scatter(PhotonState &photon, const Hit &hit, const Surface &s) {
+    Vec3f hit_point = photon.origin + hit.t * photon.direction;
+
+    Vec3f normal = hit_normal(hit, hit_point);
+
+	if constexpr (MATERIAL == LAMBERTIAN) {
+        normal = diffuse_normal(hit, normal, photon.direction);
+        if (photon.diffuse && !photon.caustic) {
+            if (diffuse_stored() < photon_budget.diffuse_capacity)
+                diffuse_photons.push_back(Photon{hit_point, -photon.direction, photon.power, hit.surface_index});
+            else
+                photon_budget.diffuse_rejected++;
+        } else if (photon.caustic && !photon.diffuse && (photon.caustic_pass || !USE_PROJECTION_MAP)) {
+            if (caustic_stored() < photon_budget.caustic_capacity)
+                caustic_photons.push_back(Photon{hit_point, -photon.direction, photon.power, hit.surface_index});
+            else
+                photon_budget.caustic_rejected++;
+        }
+        if (photon.caustic_pass) return false;
+        Vec3f albedo = s.albedo;
+        float p_rr = (albedo.x + albedo.y + albedo.z) / 3.0f;
+		if (random_uniform() >= p_rr) return false; // Absorbed
+
+        photon.origin = offset_ray_origin(hit_point, normal);
+        photon.direction = from_local(sample_unit_hemisphere(), normal);
+        photon.power = photon.power * albedo / p_rr;
+        photon.diffuse = true;
+	} else if constexpr (MATERIAL == CAUSTIC) {
+        if (dot(normal, photon.direction) > 0) { // Hit from behind
+            photon.origin = offset_ray_origin(hit_point, normal);
+            photon.direction = photon_refract(-photon.direction, -normal, false);
+        } else { // Hit from front
+            photon.origin = offset_ray_origin(hit_point, -normal);
+            photon.direction = photon_refract(-photon.direction, normal);
+        }
+        photon.caustic = true;
+	} else {
+        return false; // Materials photon tracing does not handle end the path
+	}
+
+    photon.depth++;
+    return true;
+}
+
+// Looks the material up once per hit and scatters with the matching instantiation
+bool photon_scatter(PhotonState &photon, const Hit &hit) {
+    const Surface &s = surface(hit);
+    switch (s.type) {
+        case LAMBERTIAN: return photon_scatter<LAMBERTIAN>(photon, hit, s);
+        case CAUSTIC: return photon_scatter<CAUSTIC>(photon, hit, s);
+        default: return photon_scatter<GLOSSY>(photon, hit, s);
+    }
+}
+
+void photon_trace(PhotonState photon) {
+    while (photon.depth < options.max_photon_depth) {
+        count_stat(PHOTON_RAYS);
+        Hit hit = closest_hit(photon.origin, photon.direction, scene.scene_elements, scene.mesh_geometry);
+        if (!hit.found || !photon_scatter(photon, hit)) return;
+    }
+}
+
+// Reorders in-flight photons along a Morton curve over their directions or origins so that
+// consecutive intersection tests in a batch traverse the scene coherently
+void sort_photon_batch(std::vector<PhotonState> &batch) {
+    if (options.photon_sort == NO_PHOTON_SORT || batch.size() < 2) return;
+
+    Vec3f min_dim{-1, -1, -1};
+    Vec3f max_dim{1, 1, 1};
+    if (options.photon_sort == ORIGIN_PHOTON_SORT) {
+        min_dim = Vec3f{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__};
+        max_dim = -min_dim;
+        for (const PhotonState &photon : batch) {
+            min_dim = min(min_dim, photon.origin);
+            max_dim = max(max_dim, photon.origin);
+        }
+    }
+    Vec3f inv_extent = 1.0f / max(max_dim - min_dim, Vec3f{1e-6f, 1e-6f, 1e-6f});
+
+    std::vector<std::pair<uint32_t, size_t>> keys(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        Vec3f v = options.photon_sort == ORIGIN_PHOTON_SORT ? batch[i].origin : batch[i].direction;
+        keys[i] = {morton_code((v - min_dim) * inv_extent), i};
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<PhotonState> sorted(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) sorted[i] = batch[keys[i].second];
+    batch.swap(sorted);
+}
+
+// Reorders a photon map along a Morton curve over positions before its kd-tree is built, so that
+// the photons of nearby tree nodes, and so of nearby gathers, share cache lines
+void sort_photons_morton(std::vector<Photon> &photons) {
+    if (photons.size() < 2) return;
+
+    Vec3f min_dim{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__};
+    Vec3f max_dim = -min_dim;
+    for (const Photon &photon : photons) {
+        min_dim = min(min_dim, photon.position);
+        max_dim = max(max_dim, photon.position);
+    }
+    Vec3f inv_extent = 1.0f / max(max_dim - min_dim, Vec3f{1e-6f, 1e-6f, 1e-6f});
+
+    std::vector<std::pair<uint32_t, size_t>> keys(photons.size());
+    #pragma omp parallel for schedule(static, 4096)
+    for (size_t i = 0; i < photons.size(); i++) keys[i] = {morton_code((photons[i].position - min_dim) * inv_extent), i};
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<Photon> sorted(photons.size());
+    for (size_t i = 0; i < photons.size(); i++) sorted[i] = photons[keys[i].second];
+    photons.swap(sorted);
+}
+
+// Traces a batch of photons one bounce generation at a time: every in-flight photon is
+// intersected in parallel, then deposits and Russian roulette run in order and the
+// survivors are compacted to the front of the batch for the next generation
+void photon_trace_batch(std::vector<PhotonState> &batch) {
+    std::vector<Hit> hits;
+    while (!batch.empty()) {
+        sort_photon_batch(batch);
+
+        hits.resize(batch.size());
+        count_stat(PHOTON_RAYS, batch.size());
+        #pragma omp parallel for schedule(static, 256)
+        for (size_t i = 0; i < batch.size(); i++) {
+            hits[i] = closest_hit(batch[i].origin, batch[i].direction, scene.scene_elements, scene.mesh_geometry);
+        }
+
+        size_t alive = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (hits[i].found && photon_scatter(batch[i], hits[i]) && batch[i].depth < options.max_photon_depth) {
+                batch[alive++] = batch[i];
+            }
+        }
+        batch.resize(alive);
+    }
+}
+
+// Photons to emit in the next batch. While an open map has a finite capacity, batches are kept
+// below the number of emissions it still needs at the yield seen so far: the deposits of a batch
+// land in bounce order, so a map that fills up in the middle of a large batch would keep the early
+// bounces of its photons and lose the late ones. Without a yield yet, stored budget mode probes
+// with a small batch and emitted budget mode assumes one deposit per emission.
+long next_batch_size(long remaining, bool diffuse_open, bool caustic_open) {
+    long batch_size = std::min((long)std::max(options.photon_batch_size, 1), remaining);
+    if (options.photon_batch_size <= 1) return batch_size;
+
+    auto needed = [](size_t stored, size_t capacity, long emitted) {
+        if (capacity == SIZE_MAX) return LONG_MAX;
+        if (stored == 0) return options.photon_budget_mode == STORED_BUDGET ? 4096L : (long)(0.9 * capacity);
+        return (long)(0.9 * (capacity - stored) * (double)emitted / stored);
+    };
+    long estimate = LONG_MAX;
+    if (diffuse_open) estimate = std::min(estimate, needed(diffuse_stored(), photon_budget.diffuse_capacity, photon_budget.diffuse_emitted));
+    if (caustic_open) estimate = std::min(estimate, needed(caustic_stored(), photon_budget.caustic_capacity, photon_budget.caustic_emitted));
+    return std::min(batch_size, std::max(estimate, 256L));
+}
+
+// Emissions of a batch that a map counts in its normalization. A map that filled up during the
+// batch only counts the share of the emissions whose deposits it kept, whichever budget mode
+// or memory cap made it full.
+long kept_emissions(long batch_size, size_t kept, size_t rejected) {
+    if (rejected == 0) return batch_size;
+    return std::llround((double)batch_size * kept / (kept + rejected));
+}
+
+// Emits photons from emit() until max_emitted photons have been traced or neither map that this
+// pass deposits into (as reported by open()) accepts more photons
+template<typename Open, typename Emit>
+void photon_pass(long max_emitted, Open open, Emit emit) {
+    std::vector<PhotonState> batch;
+    long emitted = 0;
+    while (emitted < max_emitted) {
+        auto [diffuse_open, caustic_open] = open();
+        if (!diffuse_open && !caustic_open) break;
+
+        long batch_size = next_batch_size(max_emitted - emitted, diffuse_open, caustic_open);
+        if (emitted / 100000 != (emitted + batch_size) / 100000 || emitted == 0) {
+            cout << emitted << endl;
+        }
+        for (long i = 0; i < batch_size; i++) {
+            batch.push_back(emit());
+        }
+        emitted += batch_size;
+
+        size_t diffuse_before = diffuse_stored(), caustic_before = caustic_stored();
+        size_t diffuse_rejected = photon_budget.diffuse_rejected, caustic_rejected = photon_budget.caustic_rejected;
+        if (options.photon_batch_size > 1) {
+            photon_trace_batch(batch);
+        } else {
+            for (const PhotonState &photon : batch) photon_trace(photon);
+        }
+        batch.clear();
+        if (diffuse_open) {
+            photon_budget.diffuse_emitted += kept_emissions(batch_size, diffuse_stored() - diffuse_before, photon_budget.diffuse_rejected - diffuse_rejected);
+        }
+        if (caustic_open) {
+            photon_budget.caustic_emitted += kept_emissions(batch_size, caustic_stored() - caustic_before, photon_budget.caustic_rejected - caustic_rejected);
+        }
+
+        if (diffuse_brick_writer != nullptr) {
+            photon_budget.diffuse_spilled += diffuse_photons.size();
+            photon_budget.caustic_spilled += caustic_photons.size();
+            diffuse_brick_writer->add(diffuse_photons);
+            caustic_brick_writer->add(caustic_photons);
+            diffuse_photons.clear();
+            caustic_photons.clear();
+        }
+    }
+}
+
+void plan_photon_budget() {
+    photon_budget = PhotonBudget();
+    // Out-of-core maps only hold one batch of deposits in memory
+    size_t max_photons = options.photon_store_prefix.empty() ? options.photon_memory_mb * 1024 * 1024 / sizeof(Photon) : SIZE_MAX;
+
+    if (options.photon_budget_mode == STORED_BUDGET) {
+        size_t diffuse_target = options.diffuse_target;
+        size_t caustic_target = options.caustic_target;
+        if (diffuse_target + caustic_target > max_photons) {
+            double scale = (double)max_photons / (diffuse_target + caustic_target);
+            diffuse_target *= scale;
+            caustic_target *= scale;
+            cout << "Photon targets reduced to " << diffuse_target << " diffuse, " << caustic_target << " caustic to fit " << options.photon_memory_mb << "MB" << endl;
+        }
+        photon_budget.diffuse_capacity = diffuse_target;
+        photon_budget.caustic_capacity = caustic_target;
+    } else {
+        photon_budget.diffuse_capacity = max_photons / 2;
+        photon_budget.caustic_capacity = max_photons / 2;
+    }
+
+    diffuse_photons.clear();
+    caustic_photons.clear();
+    if (options.photon_budget_mode == STORED_BUDGET && options.photon_store_prefix.empty()) {
+        diffuse_photons.reserve(photon_budget.diffuse_capacity);
+        caustic_photons.reserve(photon_budget.caustic_capacity);
+    }
+}
+
+void map_photons() {
+    ScopedPhase phase("photon_tracing");
+    plan_photon_budget();
+    if (!options.photon_store_prefix.empty()) {
+        BrickGrid grid = scene_brick_grid(options.photon_brick_grid);
+        diffuse_brick_writer = std::make_unique<PhotonBrickWriter>(photon_store_path(options.photon_store_prefix, "diffuse"), grid);
+        caustic_brick_writer = std::make_unique<PhotonBrickWriter>(photon_store_path(options.photon_store_prefix, "caustic"), grid);
+    }
+
+    ImportanceMap importance_map(IMPORTANCE_PATCHES, IMPORTANCE_RESOLUTION);
+    if (options.emission_mode == IMPORTANCE_EMISSION) {
+        importance_map.trace_importons(NUM_IMPORTONS);
+        importance_map.build(IMPORTANCE_PILOTS, IMPORTANCE_K);
+        cout << "Importance map built from " << importance_map.importons.size() << " importons" << endl;
+    }
+
+    float light_power = total_light_power();
+    long max_emitted = options.photon_budget_mode == STORED_BUDGET ? (long)photon_budget.diffuse_capacity * MAX_EMITTED_PER_TARGET : options.num_photons;
+    photon_pass(max_emitted, []() {
+        return std::make_pair(diffuse_stored() < photon_budget.diffuse_capacity,
+                              !USE_PROJECTION_MAP && caustic_stored() < photon_budget.caustic_capacity);
+    }, [&importance_map, light_power]() {
+        // Lights are picked in proportion to their power, so every photon carries the same power
+        Vec3f light_position, ray_direction;
+        float weight = 1;
+        int light;
+        if (options.emission_mode == IMPORTANCE_EMISSION) {
+            light = importance_map.sample(light_position, ray_direction, weight);
+        } else {
+            light = sample_light();
+            light_position = sample_light_position(scene.lights[light]);
+            ray_direction = from_local(sample_unit_hemisphere(), scene.lights[light].normal);
+        }
+        Vec3f ray_origin = offset_ray_origin(light_position, scene.lights[light].normal);
+        return PhotonState{.origin = ray_origin, .direction = ray_direction, .power = weight * Vec3f{light_power, light_power, light_power}};
+    });
+
+    if (USE_PROJECTION_MAP) {
+        ProjectionMap projection_map(PROJECTION_MAP_RESOLUTION, PROJECTION_MAP_PATCHES);
+        projection_map.build();
+        cout << "Projection map coverage " << projection_map.coverage() << endl;
+
+        // Each caustic photon stands for the whole projected solid angle, not the full hemisphere
+        float caustic_power = light_power * projection_map.coverage();
+        max_emitted = options.photon_budget_mode == STORED_BUDGET ? (long)photon_budget.caustic_capacity * MAX_EMITTED_PER_TARGET : options.num_caustic_photons;
+        if (projection_map.active_cells.empty()) max_emitted = 0;
+        photon_pass(max_emitted, []() {
+            return std::make_pair(false, caustic_stored() < photon_budget.caustic_capacity);
+        }, [&projection_map, caustic_power]() {
+            Vec3f light_position, ray_direction;
+            int light = projection_map.sample(light_position, ray_direction);
+            Vec3f ray_origin = offset_ray_origin(light_position, scene.lights[light].normal);
+            return PhotonState{.origin = ray_origin, .direction = ray_direction, .power = Vec3f{caustic_power, caustic_power, caustic_power}, .caustic_pass = true};
+        });
+    }
+
+    for (Photon &photon : diffuse_photons) photon.power /= (float)photon_budget.diffuse_emitted;
+    for (Photon &photon : caustic_photons) photon.power /= (float)photon_budget.caustic_emitted;
+    if (diffuse_brick_writer != nullptr) {
+        ScopedPhase phase("photon_store_write");
+        diffuse_brick_writer->finish((float)photon_budget.diffuse_emitted);
+        caustic_brick_writer->finish((float)photon_budget.caustic_emitted);
+        diffuse_brick_writer.reset();
+        caustic_brick_writer.reset();
+    }
+
+    cout << "Stored " << diffuse_stored() << " diffuse photons from " << photon_budget.diffuse_emitted << " emitted, "
+         << caustic_stored() << " caustic photons from " << photon_budget.caustic_emitted << " emitted" << endl;
+}
@@ -0,0 +1,591 @@
+#pragma once
+
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "common.h"
+#include "scene.h"
+#include "kdtree.h"
+#include "stats.h"
+
+const char PHOTON_STORE_MAGIC[8] = {'P', 'M', 'B', 'R', 'I', 'C', 'K', 'S'};
+const uint32_t PHOTON_STORE_VERSION = 2;
+const size_t PHOTON_SPILL_THRESHOLD = 1 << 20; // Deposits held in memory before they are spilled to disk
+const size_t PHOTON_BRICK_MAX_PHOTONS = 1 << 20; // Cells holding more are split into several bricks
+const size_t PHOTON_STREAM_BLOCK = 1 << 16; // Photons read from the spill file at a time while splitting
+const int PHOTON_SPLIT_BINS = 256;
+
+// Out-of-core photon map: photons are bucketed into a uniform grid of cells over the scene while
+// they are traced, spilled to disk, and finally written brick by brick, each brick's photons in
+// the preorder of its own kd-tree. A cell holds one brick, or several of at most
+// PHOTON_BRICK_MAX_PHOTONS photons each when it is dense. Gathers page bricks in through an LRU cache.
+// The bricks follow the header, then come the cell table and the brick records.
+struct PhotonStoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t photon_stride;
+    uint32_t num_surfaces;
+    uint32_t num_elements;
+    uint32_t grid_resolution;
+    float bounds_min[3];
+    float cell_size[3];
+    uint64_t num_photons;
+    uint64_t num_bricks;
+    uint64_t table_offset; // Of the index of each cell's first brick, one per cell and the end, then the records
+};
+
+// Index entry of one brick. The brick's data is its photons followed by one node byte per photon:
+// split dimension + 1 in the low two bits, then a left and a right child flag.
+struct BrickRecord {
+    uint64_t offset;
+    uint64_t count;
+    float bounds_min[3]; // Of the photons in the brick
+    float bounds_max[3];
+    uint64_t surface_mask; // Bit i for photons on surface i, bit 63 for every surface past 62
+};
+
+uint64_t surface_bit(int surface_index) {
+    return 1ull << std::min(surface_index, 63);
+}
+
+// Uniform grid of cells, resolution along each axis
+struct BrickGrid {
+    Vec3f bounds_min;
+    Vec3f cell_size;
+    int resolution = 0;
+
+    // Cell coordinates of p, clamped to the grid
+    void coords(const Vec3f &p, int cell[3]) const {
+        for (int a = 0; a < 3; a++) cell[a] = std::max(0, std::min(resolution - 1, (int)floorf((p[a] - bounds_min[a]) / cell_size[a])));
+    }
+    int index(int x, int y, int z) const { return (z * resolution + y) * resolution + x; }
+    int num_cells() const { return resolution * resolution * resolution; }
+};
+
+// Grid over the bounds of the scene's elements and meshes, so that cells can be assigned while photons are traced
+BrickGrid scene_brick_grid(int resolution) {
+    Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__}, bounds_max = -bounds_min;
+    for (const SceneElement &ele : scene.scene_elements) {
+        if (ele.type == SPHERE) {
+            bounds_min = min(bounds_min, ele.p1 - Vec3f{ele.r, ele.r, ele.r});
+            bounds_max = max(bounds_max, ele.p1 + Vec3f{ele.r, ele.r, ele.r});
+        } else {
+            bounds_min = min(bounds_min, min(ele.p1, min(ele.p2, ele.p3)));
+            bounds_max = max(bounds_max, max(ele.p1, max(ele.p2, ele.p3)));
+        }
+    }
+    for (const Vec3f &v : scene.mesh_geometry.vertices) {
+        bounds_min = min(bounds_min, v);
+        bounds_max = max(bounds_max, v);
+    }
+    Vec3f padding = max(bounds_max - bounds_min, Vec3f{1e-3f, 1e-3f, 1e-3f}) * 1e-3f;
+    bounds_min -= padding;
+    bounds_max += padding;
+    return BrickGrid{bounds_min, (bounds_max - bounds_min) / (float)resolution, resolution};
+}
+
+// Lower bound on the distance from x to the bricks outside the box of cells within Chebyshev
+// distance r of cell home. Infinite once the box covers the grid.
+float distance_outside_cells(const BrickGrid &grid, const Vec3f &x, const int home[3], int r) {
+    float d = __FLT_MAX__;
+    for (int a = 0; a < 3; a++) {
+        if (home[a] - r > 0) d = std::min(d, x[a] - (grid.bounds_min[a] + (home[a] - r) * grid.cell_size[a]));
+        if (home[a] + r < grid.resolution - 1) d = std::min(d, grid.bounds_min[a] + (home[a] + r + 1) * grid.cell_size[a] - x[a]);
+    }
+    return d;
+}
+
+float distance_to_brick(const BrickRecord &brick, const Vec3f &x) {
+    float d2 = 0;
+    for (int a = 0; a < 3; a++) {
+        float d = std::max(0.0f, std::max(brick.bounds_min[a] - x[a], x[a] - brick.bounds_max[a]));
+        d2 += d * d;
+    }
+    return sqrtf(d2);
+}
+
+// Balances photons[begin, end) the way KDTree::balance does, in place, and appends them to ordered
+// in the preorder of the tree with their node bytes
+void flatten_balanced(std::vector<Photon> &photons, size_t begin, size_t end, std::vector<Photon> &ordered, std::vector<uint8_t> &flags) {
+    if (end - begin == 1) {
+        ordered.push_back(photons[begin]);
+        flags.push_back(0);
+        return;
+    }
+
+    Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__}, bounds_max = -bounds_min;
+    for (size_t i = begin; i < end; i++) {
+        bounds_min = min(bounds_min, photons[i].position);
+        bounds_max = max(bounds_max, photons[i].position);
+    }
+    Vec3f extent = bounds_max - bounds_min;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+
+    size_t middle = begin + (end - begin) / 2;
+    std::nth_element(photons.begin() + begin, photons.begin() + middle, photons.begin() + end, [axis](const Photon &a, const Photon &b) {
+        return a.position[axis] < b.position[axis];
+    });
+    ordered.push_back(photons[middle]);
+    flags.push_back((axis + 1) | 4 | (middle + 1 < end ? 8 : 0));
+    flatten_balanced(photons, begin, middle, ordered, flags);
+    if (middle + 1 < end) flatten_balanced(photons, middle + 1, end, ordered, flags);
+}
+
+// Collects deposits into cells, spilling them to path.spill whenever PHOTON_SPILL_THRESHOLD are held
+class PhotonBrickWriter {
+    public:
+        PhotonBrickWriter(const std::string &given_path, const BrickGrid &given_grid);
+        void add(const std::vector<Photon> &photons);
+        // Writes the store with every power divided by num_emitted and removes the spill file
+        void finish(float num_emitted);
+    private:
+        using Chunks = std::vector<std::pair<uint64_t, uint64_t>>; // (offset, count) in the spill file
+        // Photons of a cell, or of part of one, that are still in the spill file
+        struct Piece {
+            Chunks chunks;
+            uint64_t count = 0;
+            Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__};
+            Vec3f bounds_max{-__FLT_MAX__, -__FLT_MAX__, -__FLT_MAX__};
+        };
+        std::string path;
+        BrickGrid grid;
+        std::fstream spill;
+        uint64_t spill_size = 0;
+        std::vector<std::vector<Photon>> buffers;
+        std::vector<Chunks> spilled_chunks; // Per cell
+        size_t buffered = 0;
+        void spill_buffers();
+        uint64_t append_spill(const std::vector<Photon> &photons);
+        template<typename F>
+        void stream(const Chunks &chunks, F f);
+        void read_chunks(const Chunks &chunks, std::vector<Photon> &photons);
+        void split(const Piece &piece, Piece &left, Piece &right);
+        void write_brick(std::ofstream &file, std::vector<Photon> &photons, float num_emitted, uint64_t &offset, std::vector<BrickRecord> &records);
+};
+
+PhotonBrickWriter::PhotonBrickWriter(const std::string &given_path, const BrickGrid &given_grid)
+    : path(given_path), grid(given_grid), buffers(given_grid.num_cells()), spilled_chunks(given_grid.num_cells()) {
+    spill.open(path + ".spill", std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!spill) throw std::runtime_error("cannot create " + path + ".spill");
+}
+
+void PhotonBrickWriter::add(const std::vector<Photon> &photons) {
+    for (const Photon &photon : photons) {
+        int cell[3];
+        grid.coords(photon.position, cell);
+        buffers[grid.index(cell[0], cell[1], cell[2])].push_back(photon);
+    }
+    buffered += photons.size();
+    if (buffered >= PHOTON_SPILL_THRESHOLD) spill_buffers();
+}
+
+void PhotonBrickWriter::spill_buffers() {
+    for (size_t c = 0; c < buffers.size(); c++) {
+        if (buffers[c].empty()) continue;
+        spilled_chunks[c].push_back({append_spill(buffers[c]), buffers[c].size()});
+        std::vector<Photon>().swap(buffers[c]);
+    }
+    buffered = 0;
+}
+
+// Returns the offset photons were written at
+uint64_t PhotonBrickWriter::append_spill(const std::vector<Photon> &photons) {
+    uint64_t offset = spill_size;
+    spill.seekp(offset);
+    spill.write((const char*)photons.data(), photons.size() * sizeof(Photon));
+    if (!spill) throw std::runtime_error("failed writing " + path + ".spill");
+    spill_size += photons.size() * sizeof(Photon);
+    return offset;
+}
+
+// Calls f on every photon of chunks, reading PHOTON_STREAM_BLOCK of them at a time
+template<typename F>
+void PhotonBrickWriter::stream(const Chunks &chunks, F f) {
+    std::vector<Photon> block;
+    for (auto [offset, count] : chunks) {
+        for (uint64_t done = 0; done < count; done += block.size()) {
+            block.resize(std::min<uint64_t>(count - done, PHOTON_STREAM_BLOCK));
+            spill.seekg(offset + done * sizeof(Photon));
+            spill.read((char*)block.data(), block.size() * sizeof(Photon));
+            if (!spill) throw std::runtime_error("failed reading " + path + ".spill");
+            for (const Photon &photon : block) f(photon);
+        }
+    }
+}
+
+// Appends the photons of chunks to photons
+void PhotonBrickWriter::read_chunks(const Chunks &chunks, std::vector<Photon> &photons) {
+    for (auto [offset, count] : chunks) {
+        size_t start = photons.size();
+        photons.resize(start + count);
+        spill.seekg(offset);
+        spill.read((char*)&photons[start], count * sizeof(Photon));
+        if (!spill) throw std::runtime_error("failed reading " + path + ".spill");
+    }
+}
+
+// Splits piece in two along its longest axis, at the median estimated from a histogram of the
+// photons, or halfway through them in spill order when the histogram cannot separate them. The
+// halves are streamed back into the spill file, so no more than a few blocks are in memory.
+void PhotonBrickWriter::split(const Piece &piece, Piece &left, Piece &right) {
+    Vec3f extent = piece.bounds_max - piece.bounds_min;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    float bin_scale = extent[axis] > 0 ? PHOTON_SPLIT_BINS / extent[axis] : 0;
+    auto bin_of = [&](const Photon &photon) {
+        return std::min((int)((photon.position[axis] - piece.bounds_min[axis]) * bin_scale), PHOTON_SPLIT_BINS - 1);
+    };
+
+    std::vector<uint64_t> histogram(PHOTON_SPLIT_BINS, 0);
+    stream(piece.chunks, [&](const Photon &photon) { histogram[bin_of(photon)]++; });
+    int last_left_bin = 0;
+    uint64_t left_count = histogram[0];
+    while (left_count < piece.count / 2) left_count += histogram[++last_left_bin];
+    if (left_count == piece.count) left_count -= histogram[last_left_bin--];
+    bool by_order = left_count == 0;
+
+    left = Piece{};
+    right = Piece{};
+    std::vector<Photon> left_block, right_block;
+    uint64_t streamed = 0;
+    auto flush = [&](Piece &side, std::vector<Photon> &block) {
+        if (block.empty()) return;
+        side.chunks.push_back({append_spill(block), block.size()});
+        block.clear();
+    };
+    stream(piece.chunks, [&](const Photon &photon) {
+        bool to_left = by_order ? streamed++ < piece.count / 2 : bin_of(photon) <= last_left_bin;
+        Piece &side = to_left ? left : right;
+        std::vector<Photon> &block = to_left ? left_block : right_block;
+        block.push_back(photon);
+        side.count++;
+        side.bounds_min = min(side.bounds_min, photon.position);
+        side.bounds_max = max(side.bounds_max, photon.position);
+        if (block.size() == PHOTON_STREAM_BLOCK) flush(side, block);
+    });
+    flush(left, left_block);
+    flush(right, right_block);
+}
+
+// Writes photons, emptying it, as the brick after the last of records
+void PhotonBrickWriter::write_brick(std::ofstream &file, std::vector<Photon> &photons, float num_emitted, uint64_t &offset, std::vector<BrickRecord> &records) {
+    BrickRecord record{};
+    record.offset = offset;
+    record.count = photons.size();
+    Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__}, bounds_max = -bounds_min;
+    for (Photon &photon : photons) {
+        photon.power /= num_emitted;
+        bounds_min = min(bounds_min, photon.position);
+        bounds_max = max(bounds_max, photon.position);
+        record.surface_mask |= surface_bit(photon.surface_id);
+    }
+    for (int a = 0; a < 3; a++) {
+        record.bounds_min[a] = bounds_min[a];
+        record.bounds_max[a] = bounds_max[a];
+    }
+    records.push_back(record);
+
+    std::vector<Photon> ordered;
+    std::vector<uint8_t> flags;
+    ordered.reserve(photons.size());
+    flags.reserve(photons.size());
+    flatten_balanced(photons, 0, photons.size(), ordered, flags);
+    file.write((const char*)ordered.data(), ordered.size() * sizeof(Photon));
+    file.write((const char*)flags.data(), flags.size());
+    offset += ordered.size() * (sizeof(Photon) + 1);
+    photons.clear();
+}
+
+void PhotonBrickWriter::finish(float num_emitted) {
+    PhotonStoreHeader header = {};
+    memcpy(header.magic, PHOTON_STORE_MAGIC, sizeof(header.magic));
+    header.version = PHOTON_STORE_VERSION;
+    header.photon_stride = sizeof(Photon);
+    header.num_surfaces = scene.surfaces.size();
+    header.num_elements = scene.scene_elements.size();
+    header.grid_resolution = grid.resolution;
+    for (int a = 0; a < 3; a++) {
+        header.bounds_min[a] = grid.bounds_min[a];
+        header.cell_size[a] = grid.cell_size[a];
+    }
+    std::vector<uint64_t> cell_first(grid.num_cells() + 1, 0);
+    std::vector<BrickRecord> records;
+
+    // Write to a temporary name first so that a concurrent reader never sees a partial store
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file) throw std::runtime_error("cannot create " + temporary);
+        uint64_t offset = sizeof(header);
+        file.seekp(offset);
+
+        // Only one brick is in memory at a time
+        std::vector<Photon> photons;
+        for (size_t c = 0; c < buffers.size(); c++) {
+            cell_first[c] = records.size();
+            Piece cell{.count = buffers[c].size()};
+            for (auto [chunk_offset, count] : spilled_chunks[c]) cell.count += count;
+            if (cell.count == 0) continue;
+            if (cell.count <= PHOTON_BRICK_MAX_PHOTONS) {
+                photons.swap(buffers[c]);
+                read_chunks(spilled_chunks[c], photons);
+                write_brick(file, photons, num_emitted, offset, records);
+                continue;
+            }
+
+            // Dense cells are split until their pieces fit in a brick
+            if (!buffers[c].empty()) spilled_chunks[c].push_back({append_spill(buffers[c]), buffers[c].size()});
+            std::vector<Photon>().swap(buffers[c]);
+            cell.chunks = spilled_chunks[c];
+            stream(cell.chunks, [&cell](const Photon &photon) {
+                cell.bounds_min = min(cell.bounds_min, photon.position);
+                cell.bounds_max = max(cell.bounds_max, photon.position);
+            });
+            std::vector<Piece> pieces = {cell};
+            while (!pieces.empty()) {
+                Piece piece = std::move(pieces.back());
+                pieces.pop_back();
+                if (piece.count <= PHOTON_BRICK_MAX_PHOTONS) {
+                    read_chunks(piece.chunks, photons);
+                    write_brick(file, photons, num_emitted, offset, records);
+                    continue;
+                }
+                Piece left, right;
+                split(piece, left, right);
+                pieces.push_back(std::move(right));
+                pieces.push_back(std::move(left));
+            }
+        }
+        cell_first.back() = records.size();
+        for (const BrickRecord &record : records) header.num_photons += record.count;
+        header.num_bricks = records.size();
+        header.table_offset = offset;
+
+        file.write((const char*)cell_first.data(), cell_first.size() * sizeof(uint64_t));
+        file.write((const char*)records.data(), records.size() * sizeof(BrickRecord));
+        file.seekp(0);
+        file.write((const char*)&header, sizeof(header));
+        if (!file) throw std::runtime_error("failed writing " + temporary);
+    }
+    spill.close();
+    std::remove((path + ".spill").c_str());
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) throw std::runtime_error("cannot rename " + temporary + " to " + path);
+}
+
+// Brick paged in from a store, with its kd-tree rebuilt from the node bytes
+struct PhotonBrick {
+    std::vector<Photon> photons;
+    std::vector<KDTree> nodes; // Node i holds photon i, nodes[0] is the root
+    size_t bytes() const { return photons.size() * (sizeof(Photon) + sizeof(KDTree)); }
+};
+
+// Returns false when the node bytes do not describe a tree over the brick's photons
+bool unflatten_kd(PhotonBrick &brick, const std::vector<uint8_t> &flags, size_t &next, int depth = 0) {
+    if (next >= flags.size() || depth > 64) return false;
+    size_t i = next++;
+    KDTree &node = brick.nodes[i];
+    node.photons = &brick.photons;
+    node.photon_index = i;
+    node.split_dimension = (flags[i] & 3) - 1;
+    if (flags[i] & 4) {
+        node.left = &brick.nodes[next];
+        if (!unflatten_kd(brick, flags, next, depth + 1)) return false;
+    }
+    if (flags[i] & 8) {
+        node.right = &brick.nodes[next];
+        if (!unflatten_kd(brick, flags, next, depth + 1)) return false;
+    }
+    return true;
+}
+
+// Bricks of every open store that are in memory, most recently used first. Bricks are shared, so one
+// evicted while a gather still uses it stays alive until that gather is done.
+class PhotonBrickCache {
+    public:
+        size_t capacity_bytes = 1024ull << 20;
+        template<typename Load>
+        std::shared_ptr<const PhotonBrick> get(uint64_t key, Load load);
+    private:
+        std::mutex mutex;
+        std::list<std::pair<uint64_t, std::shared_ptr<const PhotonBrick>>> entries;
+        std::unordered_map<uint64_t, decltype(entries)::iterator> lookup;
+        size_t bytes = 0;
+};
+
+PhotonBrickCache photon_brick_cache;
+
+template<typename Load>
+std::shared_ptr<const PhotonBrick> PhotonBrickCache::get(uint64_t key, Load load) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = lookup.find(key);
+        if (found != lookup.end()) {
+            entries.splice(entries.begin(), entries, found->second);
+            return found->second->second;
+        }
+    }
+
+    // Loaded outside the lock, so two threads missing the same brick may both read it
+    std::shared_ptr<const PhotonBrick> brick = load();
+    count_stat(PHOTON_BRICK_LOADS);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (lookup.count(key)) return brick;
+    entries.emplace_front(key, brick);
+    lookup[key] = entries.begin();
+    bytes += brick->bytes();
+    while (bytes > capacity_bytes && entries.size() > 1) {
+        bytes -= entries.back().second->bytes();
+        lookup.erase(entries.back().first);
+        entries.pop_back();
+    }
+    return brick;
+}
+
+// Bricks a gather has searched, held until its photons are summed. Each brick's photons are
+// queued after those of the bricks before it, so the indices can pass 2^31 in a huge store.
+struct BrickGather {
+    std::vector<std::shared_ptr<const PhotonBrick>> bricks;
+    std::vector<int64_t> first_index;
+    int64_t next_index = 0;
+
+    int64_t add(std::shared_ptr<const PhotonBrick> brick) {
+        bricks.push_back(brick);
+        first_index.push_back(next_index);
+        next_index += brick->photons.size();
+        return first_index.back();
+    }
+    const Photon &photon(int64_t index) const {
+        int b = std::upper_bound(first_index.begin(), first_index.end(), index) - first_index.begin() - 1;
+        return bricks[b]->photons[index - first_index[b]];
+    }
+};
+
+class OutOfCorePhotonMap {
+    public:
+        void open(const std::string &given_path, int given_cache_id);
+        bool empty() const { return num_photons == 0; }
+        uint64_t size() const { return num_photons; }
+        // Nearest k photons on the surface around x, searching bricks outwards from the one holding x
+        void locate_photons(const Vec3f &x, int k, int surface_index, NNQ &pq, BrickGather &gather) const;
+    private:
+        std::string path;
+        int cache_id = 0;
+        BrickGrid grid;
+        std::vector<uint64_t> cell_first; // Index into bricks of each cell's first brick, and the end
+        std::vector<BrickRecord> bricks;
+        uint64_t num_photons = 0;
+        std::shared_ptr<const PhotonBrick> load_brick(uint64_t b) const;
+};
+
+OutOfCorePhotonMap diffuse_store;
+OutOfCorePhotonMap caustic_store;
+
+void OutOfCorePhotonMap::open(const std::string &given_path, int given_cache_id) {
+    path = given_path;
+    cache_id = given_cache_id;
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot open " + path);
+
+    PhotonStoreHeader header;
+    file.read((char*)&header, sizeof(header));
+    if (!file || memcmp(header.magic, PHOTON_STORE_MAGIC, sizeof(header.magic)) != 0 || header.version != PHOTON_STORE_VERSION) {
+        throw std::runtime_error(path + ": not a photon store");
+    }
+    if (header.photon_stride != sizeof(Photon)) throw std::runtime_error(path + ": written by a build with a different photon layout");
+    if (header.num_surfaces != scene.surfaces.size() || header.num_elements != scene.scene_elements.size()) {
+        throw std::runtime_error(path + ": traced for a different scene");
+    }
+
+    if (header.grid_resolution == 0 || header.grid_resolution > 64) throw std::runtime_error(path + ": corrupt photon store");
+    grid.resolution = header.grid_resolution;
+    grid.bounds_min = Vec3f{header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]};
+    grid.cell_size = Vec3f{header.cell_size[0], header.cell_size[1], header.cell_size[2]};
+    file.seekg(0, std::ios::end);
+    uint64_t file_size = file.tellg();
+    if (header.table_offset < sizeof(header) || header.table_offset > file_size ||
+        header.num_bricks > (file_size - header.table_offset) / sizeof(BrickRecord)) {
+        throw std::runtime_error(path + ": truncated photon store");
+    }
+    cell_first.resize(grid.num_cells() + 1);
+    bricks.resize(header.num_bricks);
+    file.seekg(header.table_offset);
+    file.read((char*)cell_first.data(), cell_first.size() * sizeof(uint64_t));
+    file.read((char*)bricks.data(), bricks.size() * sizeof(BrickRecord));
+    if (!file) throw std::runtime_error(path + ": truncated photon store");
+
+    // Bricks are paged in by rendering threads, which cannot report a bad index, so it is checked here
+    if (cell_first.front() != 0 || cell_first.back() != bricks.size() || !std::is_sorted(cell_first.begin(), cell_first.end())) {
+        throw std::runtime_error(path + ": corrupt photon store");
+    }
+    for (const BrickRecord &record : bricks) {
+        if (record.count == 0 || record.count > PHOTON_BRICK_MAX_PHOTONS || record.offset < sizeof(header) ||
+            record.offset > header.table_offset || record.count * (sizeof(Photon) + 1) > header.table_offset - record.offset) {
+            throw std::runtime_error(path + ": corrupt photon store");
+        }
+    }
+    num_photons = header.num_photons;
+}
+
+// Called from rendering threads, so a brick that cannot be read ends the program here
+std::shared_ptr<const PhotonBrick> OutOfCorePhotonMap::load_brick(uint64_t b) const {
+    const BrickRecord &record = bricks[b];
+    auto brick = std::make_shared<PhotonBrick>();
+    brick->photons.resize(record.count);
+    brick->nodes.resize(record.count);
+    std::vector<uint8_t> flags(record.count);
+
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(record.offset);
+    file.read((char*)brick->photons.data(), record.count * sizeof(Photon));
+    file.read((char*)flags.data(), flags.size());
+    size_t next = 0;
+    if (!file || !unflatten_kd(*brick, flags, next) || next != flags.size()) {
+        cout << "Failed to read photon store: " << path << " brick " << b << " is unreadable" << endl;
+        exit(1);
+    }
+    return brick;
+}
+
+void OutOfCorePhotonMap::locate_photons(const Vec3f &x, int k, int surface_index, NNQ &pq, BrickGather &gather) const {
+    int home[3];
+    grid.coords(x, home);
+    uint64_t surface = surface_bit(surface_index);
+
+    // Rings of cells at Chebyshev distance r, until the k nearest cannot lie further out
+    for (int r = 0; r < grid.resolution; r++) {
+        if (r > 0 && (int)pq.size() >= k && pq.top().first <= distance_outside_cells(grid, x, home, r - 1)) break;
+        for (int z = std::max(home[2] - r, 0); z <= std::min(home[2] + r, grid.resolution - 1); z++) {
+            for (int y = std::max(home[1] - r, 0); y <= std::min(home[1] + r, grid.resolution - 1); y++) {
+                for (int cx = std::max(home[0] - r, 0); cx <= std::min(home[0] + r, grid.resolution - 1); cx++) {
+                    if (std::max({abs(cx - home[0]), abs(y - home[1]), abs(z - home[2])}) != r) continue;
+                    int cell = grid.index(cx, y, z);
+                    for (uint64_t b = cell_first[cell]; b < cell_first[cell + 1]; b++) {
+                        const BrickRecord &record = bricks[b];
+                        if (!(record.surface_mask & surface)) continue;
+                        if ((int)pq.size() >= k && distance_to_brick(record, x) >= pq.top().first) continue;
+
+                        std::shared_ptr<const PhotonBrick> brick = photon_brick_cache.get(((uint64_t)cache_id << 48) | b, [&]() { return load_brick(b); });
+                        int64_t index_base = gather.add(brick);
+                        brick->nodes[0].locate_photons(x, k, surface_index, pq, index_base);
+                    }
+                }
+            }
+        }
+    }
+}
+
+std::string photon_store_path(const std::string &prefix, const char* map) {
+    return prefix + "_" + map + ".bricks";
+}
+
+// Returns false when the stores have not been written yet
+bool open_photon_stores(const std::string &prefix) {
+    std::string diffuse_path = photon_store_path(prefix, "diffuse"), caustic_path = photon_store_path(prefix, "caustic");
+    if (!std::ifstream(diffuse_path) || !std::ifstream(caustic_path)) return false;
+    diffuse_store.open(diffuse_path, 0);
+    caustic_store.open(caustic_path, 1);
+    return true;
+}
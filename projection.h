@@ -0,0 +1,161 @@
+#pragma once
+
+#include "common.h"
+#include "scene.h"
+
+// Projection map over the lights' emission domains. Each light is split into patches x patches
+// tiles, and for each tile cell (i, j) covers r1 in [i, i+1)/resolution and r2 in [j, j+1)/resolution
+// of sample_unit_hemisphere. A cell is active when some ray from its tile can reach a CAUSTIC element.
+// Cell indices run over the tiles of light 0 first, then light 1 and so on.
+class ProjectionMap {
+    public:
+        int resolution = 0;
+        int patches = 1;
+        std::vector<int> active_cells;      // Grouped by light
+        std::vector<int> light_first_cell;  // Index into active_cells of each light's first cell, and the end
+        ProjectionMap();
+        ProjectionMap(int given_resolution, int given_patches);
+        void build();
+        float coverage();
+        // Returns the light the photon leaves from
+        int sample(Vec3f &position, Vec3f &direction);
+    private:
+        AliasTable light_distribution;  // Power over the active cells of each light
+        int cells_per_light();
+        float light_coverage(int light);
+        Vec3f cell_direction(const Light &light, float r1, float r2);
+        float cell_radius(const Light &light, int i, int j);
+};
+
+ProjectionMap::ProjectionMap() {}
+
+ProjectionMap::ProjectionMap(int given_resolution, int given_patches) {
+    resolution = given_resolution;
+    patches = given_patches;
+}
+
+int ProjectionMap::cells_per_light() {
+    return patches * patches * resolution * resolution;
+}
+
+Vec3f ProjectionMap::cell_direction(const Light &light, float r1, float r2) {
+    return from_local(sample_unit_hemisphere(r1, r2), light.normal);
+}
+
+// Angle between the cell's center direction and the farthest of its corners and edge midpoints
+float ProjectionMap::cell_radius(const Light &light, int i, int j) {
+    float cell = 1.0f / resolution;
+    Vec3f center = cell_direction(light, (i + 0.5f) * cell, (j + 0.5f) * cell);
+    float radius = 0.0f;
+    for (int a = 0; a <= 2; a++) {
+        for (int b = 0; b <= 2; b++) {
+            Vec3f corner = cell_direction(light, (i + 0.5f * a) * cell, (j + 0.5f * b) * cell);
+            radius = std::max(radius, linalg::uangle(center, corner));
+        }
+    }
+    return radius;
+}
+
+void ProjectionMap::build() {
+    // Bounding spheres of every specular element, grown per light by the tile's half diagonal so
+    // that a ray from the tile's center passing the grown sphere covers rays from anywhere on the tile
+    std::vector<std::pair<Vec3f, float>> targets;
+    for (const SceneElement &ele : scene.scene_elements) {
+        if (surface(ele).type != CAUSTIC) continue;
+        if (ele.type == SPHERE) {
+            targets.push_back({ele.p1, ele.r});
+        } else if (ele.type == TRIANGLE) {
+            Vec3f centroid = (ele.p1 + ele.p2 + ele.p3) / 3.0f;
+            float r = std::max({length(ele.p1 - centroid), length(ele.p2 - centroid), length(ele.p3 - centroid)});
+            targets.push_back({centroid, r});
+        }
+    }
+    const MeshGeometry &geometry = scene.mesh_geometry;
+    for (const Mesh &mesh : geometry.meshes) {
+        if (scene.surfaces[mesh.surface_index].type != CAUSTIC || mesh.num_triangles == 0) continue;
+        Vec3f bounds_min{__FLT_MAX__, __FLT_MAX__, __FLT_MAX__}, bounds_max = -bounds_min;
+        for (uint32_t i = 3 * mesh.first_triangle; i < 3 * (mesh.first_triangle + mesh.num_triangles); i++) {
+            bounds_min = min(bounds_min, geometry.vertices[geometry.indices[i]]);
+            bounds_max = max(bounds_max, geometry.vertices[geometry.indices[i]]);
+        }
+        targets.push_back({(bounds_min + bounds_max) / 2.0f, length(bounds_max - bounds_min) / 2.0f});
+    }
+
+    active_cells.clear();
+    light_first_cell.assign(1, 0);
+    std::vector<float> light_power;
+    for (size_t l = 0; l < scene.lights.size(); l++) {
+        const Light &light = scene.lights[l];
+        Vec3f patch_u = light.edge_u / (float)patches;
+        Vec3f patch_v = light.edge_v / (float)patches;
+        float light_radius = 0.5f * std::max(length(patch_u + patch_v), length(patch_u - patch_v)) + 0.001f;
+
+        std::vector<Vec3f> directions(resolution * resolution);
+        std::vector<float> radii(resolution * resolution);
+        float cell = 1.0f / resolution;
+        for (int i = 0; i < resolution; i++) {
+            for (int j = 0; j < resolution; j++) {
+                directions[i * resolution + j] = cell_direction(light, (i + 0.5f) * cell, (j + 0.5f) * cell);
+                radii[i * resolution + j] = 1.1f * cell_radius(light, i, j);
+            }
+        }
+
+        for (int patch = 0; patch < patches * patches; patch++) {
+            // light_point mirrors the half of a triangle light's diagonal patches past the hypotenuse
+            // onto the patch mirrored across it, so those patches emit from around both centers
+            int a = patch / patches, b = patch % patches;
+            std::vector<Vec3f> light_centers = {light_point(light, (a + 0.5f) / patches, (b + 0.5f) / patches)};
+            if (light.type == TRIANGLE_LIGHT && a + b == patches - 1 && a != b) {
+                light_centers.push_back(light_point(light, (b + 0.5f) / patches, (a + 0.5f) / patches));
+            }
+            for (int c = 0; c < resolution * resolution; c++) {
+                bool active = false;
+                for (Vec3f light_center : light_centers) {
+                    for (auto [center, r] : targets) {
+                        r += light_radius;
+                        float d = length(center - light_center);
+                        if (d <= r || linalg::uangle(directions[c], (center - light_center) / d) <= asinf(r / d) + radii[c]) {
+                            active = true;
+                            break;
+                        }
+                    }
+                    if (active) break;
+                }
+                if (active) active_cells.push_back((l * patches * patches + patch) * resolution * resolution + c);
+            }
+        }
+        light_first_cell.push_back(active_cells.size());
+        light_power.push_back(light_coverage(l));
+    }
+    light_distribution = AliasTable(light_power);
+}
+
+// Share of the light's emitted power that leaves through its active cells
+float ProjectionMap::light_coverage(int light) {
+    return light_probability(light) * (light_first_cell[light + 1] - light_first_cell[light]) / cells_per_light();
+}
+
+// Share of the total emitted power that leaves through active cells, i.e. the weight of a projected
+// photon relative to the total light power
+float ProjectionMap::coverage() {
+    float total = 0;
+    for (size_t l = 0; l < scene.lights.size(); l++) total += light_coverage(l);
+    return total;
+}
+
+// Cells are picked in proportion to the power they emit: a light by the power of its active cells,
+// then one of its active cells uniformly
+int ProjectionMap::sample(Vec3f &position, Vec3f &direction) {
+    int light = scene.lights.size() == 1 ? 0 : light_distribution.sample(random_uniform());
+    int first = light_first_cell[light], count = light_first_cell[light + 1] - first;
+    int cell_index = active_cells[first + std::min((int)(random_uniform() * count), count - 1)] % cells_per_light();
+    int patch = cell_index / (resolution * resolution);
+    int i = cell_index % (resolution * resolution) / resolution;
+    int j = cell_index % resolution;
+
+    float u = (patch / patches + random_uniform()) / patches;
+    float v = (patch % patches + random_uniform()) / patches;
+    position = light_point(scene.lights[light], u, v);
+    direction = cell_direction(scene.lights[light], (i + random_uniform()) / resolution, (j + random_uniform()) / resolution);
+    return light;
+}
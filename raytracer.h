@@ -1,17 +1,21 @@
+#pragma once
+
 #include "common.h"
+#include "mesh.h"
+#include "stats.h"
 
 // Möller–Trumbore intersection algorithm
-std::tuple<bool, float> ray_triangle_intersect(SceneElement triangle, Vec3f ray_origin, Vec3f ray_direction) {
+std::tuple<bool, float> ray_triangle_intersect(const Vec3f &p1, const Vec3f &p2, const Vec3f &p3, const Vec3f &ray_origin, const Vec3f &ray_direction) {
     float eps = std::numeric_limits<float>::epsilon();
 
-    Vec3f edge1 = triangle.p2 - triangle.p1;
-    Vec3f edge2 = triangle.p3 - triangle.p1;
+    Vec3f edge1 = p2 - p1;
+    Vec3f edge2 = p3 - p1;
     float det = linalg::dot(edge1, linalg::cross(ray_direction, edge2));
 
     if (det < eps && det > eps) return {false, -1};
 
     float inv_det = 1.0 / det;
-    Vec3f s = ray_origin - triangle.p1;
+    Vec3f s = ray_origin - p1;
     float u = inv_det * linalg::dot(s, linalg::cross(ray_direction, edge2));
 
     if (u < 0 || u > 1) return {false, -1};
@@ -26,7 +30,11 @@ std::tuple<bool, float> ray_triangle_intersect(SceneElement triangle, Vec3f ray_
     else return {false, -1};
 }
 
-std::tuple<bool, float> ray_sphere_intersect(const SceneElement &sphere, const Vec3f &ray_origin, const Vec3f ray_direction) {
+std::tuple<bool, float> ray_triangle_intersect(const SceneElement &triangle, const Vec3f &ray_origin, const Vec3f &ray_direction) {
+    return ray_triangle_intersect(triangle.p1, triangle.p2, triangle.p3, ray_origin, ray_direction);
+}
+
+std::tuple<bool, float> ray_sphere_intersect(const SceneElement &sphere, const Vec3f &ray_origin, const Vec3f &ray_direction) {
     Vec3f V = ray_origin - sphere.p1;
 	float a = dot(ray_direction, ray_direction);
     float b = 2.0f * dot(ray_direction, V);
@@ -54,22 +62,72 @@ std::tuple<bool, float> ray_sphere_intersect(const SceneElement &sphere, const V
     return {true, std::min(t1, t2)};
 }
 
-std::tuple<bool, float, SceneElement> closest_hit(Vec3f ray_origin, Vec3f ray_direction, std::vector<SceneElement> &scene_elements) {
-    float min_t_val = __FLT_MAX__;
-    SceneElement hit;
-    for (SceneElement ele : scene_elements) {
-        bool any_hit;
-        float t;
+// Closest mesh triangle closer than t, found by front-to-back traversal of the mesh BVH
+bool ray_mesh_intersect(const MeshGeometry &geometry, Vec3f ray_origin, Vec3f ray_direction, float &t, uint32_t &triangle) {
+    if (geometry.bvh_nodes.empty()) return false;
+
+    Vec3f inv_direction = 1.0f / ray_direction;
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    bool any_hit = false;
+
+    if (ray_box_intersect(geometry.bvh_nodes[0], ray_origin, inv_direction, t) == __FLT_MAX__) return false;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const BVHNode &node = geometry.bvh_nodes[stack[--stack_size]];
+        if (node.count > 0) {
+            count_stat(PRIMITIVE_TESTS, node.count);
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                uint32_t tri = geometry.bvh_triangles[i];
+                const uint32_t *index = &geometry.indices[3 * tri];
+                auto [hit, t_tri] = ray_triangle_intersect(geometry.vertices[index[0]], geometry.vertices[index[1]], geometry.vertices[index[2]], ray_origin, ray_direction);
+                if (hit && t_tri < t) {
+                    t = t_tri;
+                    triangle = tri;
+                    any_hit = true;
+                }
+            }
+            continue;
+        }
+
+        float t_left = ray_box_intersect(geometry.bvh_nodes[node.first], ray_origin, inv_direction, t);
+        float t_right = ray_box_intersect(geometry.bvh_nodes[node.first + 1], ray_origin, inv_direction, t);
+        uint32_t near_child = t_left <= t_right ? node.first : node.first + 1;
+        uint32_t far_child = t_left <= t_right ? node.first + 1 : node.first;
+        if (std::max(t_left, t_right) != __FLT_MAX__) stack[stack_size++] = far_child;
+        if (std::min(t_left, t_right) != __FLT_MAX__) stack[stack_size++] = near_child;
+    }
+    return any_hit;
+}
+
+// Nearest intersection along a ray. The element is referred to by index instead of being copied
+// out of the scene; mesh triangles have no element and are referred to by triangle.
+struct Hit {
+    bool found = false;
+    int type = TRIANGLE;        // TRIANGLE, SPHERE or MESH_TRIANGLE
+    uint32_t index = 0;         // Into the scene elements, or the mesh triangle for MESH_TRIANGLE
+    int surface_index = -1;
+    float t = __FLT_MAX__;
+};
+
+Hit closest_hit(const Vec3f &ray_origin, const Vec3f &ray_direction, const std::vector<SceneElement> &scene_elements, const MeshGeometry &geometry) {
+    Hit hit;
+    count_stat(PRIMITIVE_TESTS, scene_elements.size());
+    for (uint32_t i = 0; i < scene_elements.size(); i++) {
+        const SceneElement &ele = scene_elements[i];
+        bool any_hit = false;
+        float t = __FLT_MAX__;
         if (ele.type == TRIANGLE) {
             std::tie(any_hit, t) = ray_triangle_intersect(ele, ray_origin, ray_direction);
         } else if (ele.type == SPHERE) {
             std::tie(any_hit, t) = ray_sphere_intersect(ele, ray_origin, ray_direction);
         }
-        if (any_hit && t < min_t_val) {
-            min_t_val = t;
-            hit = ele;
-        }
+        if (any_hit && t < hit.t) hit = Hit{true, ele.type, i, ele.surface_index, t};
     }
 
-    return {min_t_val != __FLT_MAX__, min_t_val, hit};
+    uint32_t triangle;
+    if (ray_mesh_intersect(geometry, ray_origin, ray_direction, hit.t, triangle)) {
+        hit = Hit{true, MESH_TRIANGLE, triangle, geometry.mesh_of(triangle).surface_index, hit.t};
+    }
+    return hit;
 }
\ No newline at end of file
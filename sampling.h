@@ -0,0 +1,90 @@
+#pragma once
+
+#include "common.h"
+
+// Piecewise-constant distribution over n bins, sampled by inverting its CDF
+class Distribution1D {
+    public:
+        std::vector<float> weights;
+        std::vector<float> cdf;
+        float total = 0;
+        Distribution1D();
+        Distribution1D(const std::vector<float> &given_weights);
+        int sample(float u);
+        float pdf(int bin);
+};
+
+Distribution1D::Distribution1D() {}
+
+Distribution1D::Distribution1D(const std::vector<float> &given_weights) {
+    weights = given_weights;
+    cdf = std::vector<float>(weights.size());
+    std::partial_sum(weights.begin(), weights.end(), cdf.begin());
+    total = cdf.empty() ? 0 : cdf.back();
+}
+
+int Distribution1D::sample(float u) {
+    int bin = std::upper_bound(cdf.begin(), cdf.end(), u * total) - cdf.begin();
+    return std::min(bin, (int)cdf.size() - 1);
+}
+
+float Distribution1D::pdf(int bin) {
+    return weights[bin] / total;
+}
+
+// Walker's alias table over n weights: one uniform number picks a bin in constant time. Bins
+// are split into a threshold and an alias with Vose's method.
+class AliasTable {
+    public:
+        std::vector<float> probabilities; // Normalized weights
+        AliasTable();
+        AliasTable(const std::vector<float> &weights);
+        int sample(float u) const;
+        float pdf(int bin) const;
+    private:
+        std::vector<float> thresholds;
+        std::vector<int> aliases;
+};
+
+AliasTable::AliasTable() {}
+
+AliasTable::AliasTable(const std::vector<float> &weights) {
+    int n = weights.size();
+    double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    probabilities.resize(n);
+    thresholds.resize(n);
+    aliases.resize(n);
+
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; i++) {
+        probabilities[i] = total > 0 ? weights[i] / total : 1.0 / n;
+        scaled[i] = probabilities[i] * n;
+        aliases[i] = i;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        thresholds[s] = scaled[s];
+        aliases[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left is 1 up to rounding
+    for (int i : small) thresholds[i] = 1;
+    for (int i : large) thresholds[i] = 1;
+}
+
+int AliasTable::sample(float u) const {
+    float scaled = u * thresholds.size();
+    int bin = std::min((int)scaled, (int)thresholds.size() - 1);
+    return scaled - bin < thresholds[bin] ? bin : aliases[bin];
+}
+
+float AliasTable::pdf(int bin) const {
+    return probabilities[bin];
+}
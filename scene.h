@@ -1,5 +1,26 @@
+#pragma once
+
 #include "common.h"
 #include "material.h"
+#include "mesh.h"
+#include "raytracer.h"
+#include "sampling.h"
+
+const int QUAD_LIGHT = 0;
+const int TRIANGLE_LIGHT = 1;
+
+// Area light spanned by edge_u and edge_v from corner: the parallelogram, or the triangle on its
+// near half. It emits power on the side of normal, and its elements use surface_index.
+struct Light {
+    int type;
+    Vec3f corner;
+    Vec3f edge_u;
+    Vec3f edge_v;
+    Vec3f normal;
+    float area;
+    float power;
+    int surface_index;
+};
 
 struct Scene {
     Vec3f ip_bottom_left = {0.558156, -0, -0.0057560205};
@@ -19,12 +40,27 @@ struct Scene {
     float light_z = 0.545f;
     float light_len_x = 0.16f;
     float light_len_y = 0.16f;
-	float inv_light_area = 1.0f / light_len_x / light_len_y;
-	Vec3f light_normal{0.0f, 0.0f, -1.0f};
+
+	// The Cornell box's ceiling light comes first, lights added with add_light() follow
+	std::vector<Light> lights = {
+		Light{
+			.type = QUAD_LIGHT,
+			.corner = Vec3f{light_x, light_y, light_z},
+			.edge_u = Vec3f{light_len_x, 0.0f, 0.0f},
+			.edge_v = Vec3f{0.0f, light_len_y, 0.0f},
+			.normal = Vec3f{0.0f, 0.0f, -1.0f},
+			.area = light_len_x * light_len_y,
+			.power = 1.0f,
+			.surface_index = 0
+		}
+	};
+
+	MeshGeometry mesh_geometry;
 
 	std::vector<Surface> surfaces = {
 		Surface{
 			.type = LAMBERTIAN,
+			.emitter = true,
 			.normal = Vec3f{0.0f, 0.0f, -1.0f},
 			.albedo = Vec3f{0.874000013f, 0.874000013f, 0.875000000f}
 		},
@@ -358,14 +394,103 @@ struct Scene {
 
 Scene scene;
 
-Vec3f sample_light_position() {
-    return Vec3f{scene.light_x + scene.light_len_x * random_uniform(), scene.light_y + scene.light_len_y * random_uniform(), scene.light_z};
+// Alias table over the powers of scene.lights, rebuilt by update_lights()
+AliasTable light_sampler;
+
+void update_lights() {
+    std::vector<float> powers;
+    for (const Light &light : scene.lights) powers.push_back(light.power);
+    light_sampler = AliasTable(powers);
+}
+
+// Adds an emitting surface with the light's elements. Every light has its own surface, so that a
+// shadow ray can tell whether it reached the light it was aimed at.
+void add_light(int type, Vec3f corner, Vec3f edge_u, Vec3f edge_v, float power) {
+    Vec3f normal_area = cross(edge_u, edge_v);
+    int surface_index = scene.surfaces.size();
+    Light light{
+        .type = type,
+        .corner = corner,
+        .edge_u = edge_u,
+        .edge_v = edge_v,
+        .normal = normalize(normal_area),
+        .area = length(normal_area) * (type == TRIANGLE_LIGHT ? 0.5f : 1.0f),
+        .power = power,
+        .surface_index = surface_index
+    };
+    scene.surfaces.push_back(Surface{.type = LAMBERTIAN, .emitter = true, .normal = light.normal, .albedo = scene.surfaces[0].albedo});
+    scene.scene_elements.push_back(SceneElement{.type = TRIANGLE, .p1 = corner, .p2 = corner + edge_u, .p3 = corner + edge_v, .surface_index = surface_index});
+    if (type == QUAD_LIGHT) {
+        scene.scene_elements.push_back(SceneElement{.type = TRIANGLE, .p1 = corner + edge_u, .p2 = corner + edge_u + edge_v, .p3 = corner + edge_v, .surface_index = surface_index});
+    }
+    scene.lights.push_back(light);
+}
+
+float total_light_power() {
+    float total = 0;
+    for (const Light &light : scene.lights) total += light.power;
+    return total;
+}
+
+// Index of a light picked in proportion to its power. A lone light draws no random number.
+int sample_light() {
+    return scene.lights.size() == 1 ? 0 : light_sampler.sample(random_uniform());
 }
 
-Surface surface(SceneElement ele) {
+float light_probability(int light) {
+    return scene.lights.size() == 1 ? 1.0f : light_sampler.pdf(light);
+}
+
+// Point at (u, v) in [0, 1]^2 of the light's parallelogram, folded onto the near half for triangles
+Vec3f light_point(const Light &light, float u, float v) {
+    if (light.type == TRIANGLE_LIGHT && u + v > 1) {
+        u = 1 - u;
+        v = 1 - v;
+    }
+    return light.corner + light.edge_u * u + light.edge_v * v;
+}
+
+Vec3f sample_light_position(const Light &light) {
+    float u = random_uniform();
+    float v = random_uniform();
+    return light_point(light, u, v);
+}
+
+Vec3f camera_ray_direction(float u, float v) {
+    Vec3f position_on_image_plane = scene.ip_bottom_left + u * scene.ip_right_vector + (1.0f - v) * scene.ip_up_vector;
+    return linalg::normalize(position_on_image_plane - scene.camera_position);
+}
+
+const Surface &surface(const SceneElement &ele) {
 	return scene.surfaces[ele.surface_index];
 }
 
-bool is_emitter(SceneElement ele) {
-	return ele.surface_index == 0;
+const Surface &surface(const Hit &hit) {
+	return scene.surfaces[hit.surface_index];
+}
+
+bool is_emitter(const SceneElement &ele) {
+	return surface(ele).emitter;
+}
+
+bool is_emitter(const Hit &hit) {
+	return hit.found && surface(hit).emitter;
+}
+
+// Geometric normal at a hit, read from the scene rather than from a copy of the element
+Vec3f hit_normal(const Hit &hit, Vec3f position) {
+	if (hit.type == SPHERE) return normal_sphere(scene.scene_elements[hit.index], position);
+	if (hit.type == MESH_TRIANGLE) {
+		const uint32_t *index = &scene.mesh_geometry.indices[3 * hit.index];
+		const Span<Vec3f> &vertices = scene.mesh_geometry.vertices;
+		return normalize(cross(vertices[index[1]] - vertices[index[0]], vertices[index[2]] - vertices[index[0]]));
+	}
+	return surface(hit).normal;
+}
+
+// hit_normal turned toward the side of a diffuse surface that the ray arrives from. The authored
+// triangles already face into the box, but mesh triangles can be seen from either side.
+Vec3f diffuse_normal(const Hit &hit, Vec3f normal, Vec3f ray_direction) {
+	if (hit.type == MESH_TRIANGLE && dot(normal, ray_direction) > 0) return -normal;
+	return normal;
 }
\ No newline at end of file
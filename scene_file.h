@@ -0,0 +1,161 @@
+#pragma once
+
+#include <memory>
+
+#include "common.h"
+#include "scene.h"
+#include "mesh_loader.h"
+
+const char SCENE_FILE_MAGIC[8] = {'P', 'M', 'S', 'C', 'E', 'N', 'E', '\0'};
+const uint32_t SCENE_FILE_VERSION = 2;
+const uint32_t SCENE_FILE_BYTE_ORDER = 0x01020304;
+const uint64_t SCENE_FILE_ALIGNMENT = 64;
+
+enum SceneFileSectionId {
+    ELEMENTS_SECTION,
+    SURFACES_SECTION,
+    VERTICES_SECTION,
+    INDICES_SECTION,
+    MESHES_SECTION,
+    BVH_NODES_SECTION,
+    BVH_TRIANGLES_SECTION,
+    LIGHTS_SECTION,
+    NUM_SCENE_FILE_SECTIONS
+};
+
+struct SceneFileSection {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t stride;
+};
+
+// Header of a compiled scene. It is followed by SCENE_FILE_ALIGNMENT aligned sections of raw
+// structs, so a file only loads into a build with the same byte order and struct layouts.
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    SceneFileSection sections[NUM_SCENE_FILE_SECTIONS];
+};
+
+// Keeps the mapped compiled scene alive while scene.mesh_geometry points into it
+std::unique_ptr<MappedFile> scene_file_mapping;
+
+uint64_t align_scene_offset(uint64_t offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+// Writes the current scene, including the mesh BVH built by MeshGeometry::build, to path
+void write_scene_file(const std::string &path) {
+    const MeshGeometry &geometry = scene.mesh_geometry;
+    struct { const void* data; uint64_t count; uint64_t stride; } tables[NUM_SCENE_FILE_SECTIONS] = {
+        {scene.scene_elements.data(), scene.scene_elements.size(), sizeof(SceneElement)},
+        {scene.surfaces.data(), scene.surfaces.size(), sizeof(Surface)},
+        {geometry.vertices.data, geometry.vertices.size(), sizeof(Vec3f)},
+        {geometry.indices.data, geometry.indices.size(), sizeof(uint32_t)},
+        {geometry.meshes.data, geometry.meshes.size(), sizeof(Mesh)},
+        {geometry.bvh_nodes.data, geometry.bvh_nodes.size(), sizeof(BVHNode)},
+        {geometry.bvh_triangles.data, geometry.bvh_triangles.size(), sizeof(uint32_t)},
+        {scene.lights.data(), scene.lights.size(), sizeof(Light)},
+    };
+
+    SceneFileHeader header = {};
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_FILE_VERSION;
+    header.byte_order = SCENE_FILE_BYTE_ORDER;
+
+    uint64_t offset = align_scene_offset(sizeof(SceneFileHeader));
+    for (int s = 0; s < NUM_SCENE_FILE_SECTIONS; s++) {
+        header.sections[s] = SceneFileSection{offset, tables[s].count, tables[s].stride};
+        offset = align_scene_offset(offset + tables[s].count * tables[s].stride);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("cannot create " + path);
+    std::vector<char> padding(SCENE_FILE_ALIGNMENT, 0);
+    file.write((const char*)&header, sizeof(header));
+    uint64_t written = sizeof(header);
+    for (int s = 0; s < NUM_SCENE_FILE_SECTIONS; s++) {
+        file.write(padding.data(), header.sections[s].offset - written);
+        file.write((const char*)tables[s].data, tables[s].count * tables[s].stride);
+        written = header.sections[s].offset + tables[s].count * tables[s].stride;
+    }
+    file.write(padding.data(), align_scene_offset(written) - written);
+    if (!file) throw std::runtime_error("failed writing " + path);
+}
+
+template<typename T>
+Span<T> scene_file_section(const SceneFileHeader &header, SceneFileSectionId id, const std::string &path) {
+    const SceneFileSection &section = header.sections[id];
+    if (section.stride != sizeof(T)) throw std::runtime_error(path + ": compiled with a different struct layout, recompile the scene");
+    uint64_t size = scene_file_mapping->size;
+    if (section.offset % SCENE_FILE_ALIGNMENT != 0 || section.offset > size || section.count > (size - section.offset) / section.stride) {
+        throw std::runtime_error(path + ": corrupt section table");
+    }
+    return Span<T>((const T*)(scene_file_mapping->data + section.offset), section.count);
+}
+
+// Checks every index of a mapped scene against the table it points into, since the renderer
+// follows them without bounds checks
+void check_scene_file(const std::string &path) {
+    auto valid_surface = [](int surface_index) { return surface_index >= 0 && (size_t)surface_index < scene.surfaces.size(); };
+    for (const SceneElement &ele : scene.scene_elements) {
+        if (!valid_surface(ele.surface_index)) throw std::runtime_error(path + ": corrupt scene element");
+    }
+    for (const Light &light : scene.lights) {
+        if (!valid_surface(light.surface_index)) throw std::runtime_error(path + ": corrupt light");
+    }
+
+    const MeshGeometry &geometry = scene.mesh_geometry;
+    for (uint32_t index : geometry.indices) {
+        if (index >= geometry.vertices.size()) throw std::runtime_error(path + ": mesh index out of range");
+    }
+    // mesh_of() needs the meshes to tile the triangles in order
+    uint64_t next_triangle = 0;
+    for (const Mesh &mesh : geometry.meshes) {
+        if (mesh.first_triangle != next_triangle || mesh.num_triangles == 0 || !valid_surface(mesh.surface_index)) {
+            throw std::runtime_error(path + ": corrupt mesh table");
+        }
+        next_triangle += mesh.num_triangles;
+    }
+    if (3 * next_triangle != geometry.indices.size()) throw std::runtime_error(path + ": corrupt mesh table");
+
+    for (uint32_t tri : geometry.bvh_triangles) {
+        if (tri >= geometry.num_triangles()) throw std::runtime_error(path + ": corrupt BVH");
+    }
+    for (const BVHNode &node : geometry.bvh_nodes) {
+        if (node.count > 0 && (uint64_t)node.first + node.count > geometry.bvh_triangles.size()) throw std::runtime_error(path + ": corrupt BVH");
+    }
+}
+
+// Maps a compiled scene and renders from it in place. The small element, surface and light tables
+// are copied into scene, the mesh buffers and BVH are used directly from the mapping.
+void map_scene_file(const std::string &path) {
+    scene_file_mapping = std::make_unique<MappedFile>(path);
+    if (scene_file_mapping->size < sizeof(SceneFileHeader)) throw std::runtime_error(path + ": not a compiled scene");
+
+    SceneFileHeader header;
+    memcpy(&header, scene_file_mapping->data, sizeof(header));
+    if (memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0) throw std::runtime_error(path + ": not a compiled scene");
+    if (header.version != SCENE_FILE_VERSION) throw std::runtime_error(path + ": unsupported scene file version " + std::to_string(header.version));
+    if (header.byte_order != SCENE_FILE_BYTE_ORDER) throw std::runtime_error(path + ": compiled on a machine with a different byte order");
+
+    Span<SceneElement> elements = scene_file_section<SceneElement>(header, ELEMENTS_SECTION, path);
+    Span<Surface> surfaces = scene_file_section<Surface>(header, SURFACES_SECTION, path);
+    scene.scene_elements.assign(elements.begin(), elements.end());
+    scene.surfaces.assign(surfaces.begin(), surfaces.end());
+
+    MeshGeometry &geometry = scene.mesh_geometry;
+    geometry.vertices = scene_file_section<Vec3f>(header, VERTICES_SECTION, path);
+    geometry.indices = scene_file_section<uint32_t>(header, INDICES_SECTION, path);
+    geometry.meshes = scene_file_section<Mesh>(header, MESHES_SECTION, path);
+    geometry.bvh_nodes = scene_file_section<BVHNode>(header, BVH_NODES_SECTION, path);
+    geometry.bvh_triangles = scene_file_section<uint32_t>(header, BVH_TRIANGLES_SECTION, path);
+    if (geometry.bvh_triangles.size() != geometry.num_triangles()) throw std::runtime_error(path + ": BVH does not match the mesh buffers");
+    if (bvh_depth(geometry.bvh_nodes.data, geometry.bvh_nodes.size()) < 0) throw std::runtime_error(path + ": corrupt or too deep BVH, recompile the scene");
+
+    Span<Light> lights = scene_file_section<Light>(header, LIGHTS_SECTION, path);
+    if (lights.size() == 0) throw std::runtime_error(path + ": scene has no lights");
+    scene.lights.assign(lights.begin(), lights.end());
+    check_scene_file(path);
+}
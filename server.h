@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdio>
+#include <stdexcept>
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "scene.h"
+#include "camera.h"
+
+const int MAX_JOB_RESOLUTION = 16384;
+
+// One request of the render server protocol. A job is a single line
+//     render [width=W] [height=H] [spp=N] [camera=px,py,pz,tx,ty,tz[,fov]] [region=x0,y0,x1,y1]
+// where omitted fields keep the server's startup values and the region defaults to the whole image.
+// The reply is "ok x0 y0 x1 y1" followed by the region's rows, top to bottom, as host byte order
+// float32 RGB written as soon as each band of rows is done, or a single "error <message>" line.
+// "quit" stops the server.
+struct RenderJob {
+    int width;
+    int height;
+    int spp;
+    CameraPose camera;
+    ImageRegion region;
+    bool has_camera = false;
+};
+
+std::vector<float> parse_job_numbers(const std::string &key, const std::string &value) {
+    std::vector<float> numbers;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        size_t end = 0;
+        try {
+            numbers.push_back(std::stof(item, &end));
+        } catch (const std::exception &) {}
+        if (end == 0 || end != item.size()) throw std::runtime_error("invalid " + key + " '" + value + "'");
+    }
+    return numbers;
+}
+
+int parse_job_int(const std::string &key, const std::string &value, int min, int max) {
+    std::vector<float> numbers = parse_job_numbers(key, value);
+    if (numbers.size() != 1 || numbers[0] != (int)numbers[0] || numbers[0] < min || numbers[0] > max) {
+        throw std::runtime_error("invalid " + key + " '" + value + "'");
+    }
+    return numbers[0];
+}
+
+// Fields after the "render" command, applied over the defaults in job
+void parse_render_job(std::istringstream &line, RenderJob &job) {
+    bool has_region = false;
+    std::string field;
+    while (line >> field) {
+        size_t equals = field.find('=');
+        std::string key = field.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : field.substr(equals + 1);
+        if (key == "width") {
+            job.width = parse_job_int(key, value, 1, MAX_JOB_RESOLUTION);
+        } else if (key == "height") {
+            job.height = parse_job_int(key, value, 1, MAX_JOB_RESOLUTION);
+        } else if (key == "spp") {
+            job.spp = parse_job_int(key, value, 1, 1 << 20);
+        } else if (key == "camera") {
+            std::vector<float> camera = parse_job_numbers(key, value);
+            if (camera.size() != 6 && camera.size() != 7) throw std::runtime_error("camera needs px,py,pz,tx,ty,tz[,fov]");
+            job.camera.position = Vec3f{camera[0], camera[1], camera[2]};
+            job.camera.target = Vec3f{camera[3], camera[4], camera[5]};
+            if (camera.size() == 7) job.camera.vertical_fov = camera[6];
+            job.has_camera = true;
+            Vec3f forward = job.camera.target - job.camera.position;
+            if (length2(cross(forward, Vec3f{0.0f, 0.0f, 1.0f})) <= 1e-8f * length2(forward) || job.camera.vertical_fov <= 0 || job.camera.vertical_fov >= 180) {
+                throw std::runtime_error("degenerate camera");
+            }
+        } else if (key == "region") {
+            std::vector<float> region = parse_job_numbers(key, value);
+            if (region.size() != 4) throw std::runtime_error("region needs x0,y0,x1,y1");
+            job.region = ImageRegion{(int)region[0], (int)region[1], (int)region[2], (int)region[3]};
+            has_region = true;
+        } else {
+            throw std::runtime_error("unknown field '" + field + "'");
+        }
+    }
+
+    if (!has_region) job.region = ImageRegion{0, 0, job.width, job.height};
+    if (job.region.x0 < 0 || job.region.y0 < 0 || job.region.x1 > job.width || job.region.y1 > job.height ||
+        job.region.width() <= 0 || job.region.height() <= 0) {
+        throw std::runtime_error("region outside the image");
+    }
+}
+
+bool read_job_line(FILE* in, std::string &line) {
+    line.clear();
+    for (int c = fgetc(in); c != EOF; c = fgetc(in)) {
+        if (c == '\n') return true;
+        if (c != '\r') line.push_back(c);
+    }
+    return !line.empty();
+}
+
+// Answers jobs from in until end of input (returns true) or a "quit" (returns false).
+// render(region, spp, band_done) renders with the scene camera and resolution already set and calls
+// band_done(first_row, end_row, band) with each finished band of rows.
+template<typename Render>
+bool serve_jobs(FILE* in, FILE* out, const RenderJob &defaults, Render render) {
+    // Jobs without a camera get the startup image plane back as is rather than rebuilt by look_at,
+    // so that they reproduce a plain render bit for bit
+    const Vec3f camera_position = scene.camera_position;
+    const Vec3f ip_bottom_left = scene.ip_bottom_left;
+    const Vec3f ip_up_vector = scene.ip_up_vector;
+    const Vec3f ip_right_vector = scene.ip_right_vector;
+
+    std::string text;
+    while (read_job_line(in, text)) {
+        std::istringstream line(text);
+        std::string command;
+        if (!(line >> command)) continue;
+        if (command == "quit") return false;
+
+        RenderJob job = defaults;
+        try {
+            if (command != "render") throw std::runtime_error("unknown command '" + command + "'");
+            parse_render_job(line, job);
+        } catch (const std::exception &e) {
+            fprintf(out, "error %s\n", e.what());
+            fflush(out);
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        scene.image_width = job.width;
+        scene.image_height = job.height;
+        if (job.has_camera || job.width != defaults.width || job.height != defaults.height) {
+            look_at(job.camera);
+        } else {
+            scene.camera_position = camera_position;
+            scene.ip_bottom_left = ip_bottom_left;
+            scene.ip_up_vector = ip_up_vector;
+            scene.ip_right_vector = ip_right_vector;
+        }
+        fprintf(out, "ok %d %d %d %d\n", job.region.x0, job.region.y0, job.region.x1, job.region.y1);
+
+        std::vector<float> packed;
+        render(job.region, job.spp, [&](int first_row, int end_row, const Vec3f* band) {
+            size_t count = (size_t)(end_row - first_row) * job.region.width();
+            if (sizeof(Vec3f) == 3 * sizeof(float)) {
+                fwrite(band, sizeof(Vec3f), count, out);
+            } else {
+                // Padded Vec3f (USE_SIMD_VEC) is packed to three floats per pixel
+                packed.resize(3 * count);
+                for (size_t i = 0; i < count; i++) memcpy(&packed[3 * i], &band[i], 3 * sizeof(float));
+                fwrite(packed.data(), 3 * sizeof(float), count, out);
+            }
+            fflush(out);
+        });
+        if (ferror(out)) return true; // Client went away
+
+        std::cerr << "Job " << job.width << "x" << job.height << " region " << job.region.x0 << "," << job.region.y0 << ","
+                  << job.region.x1 << "," << job.region.y1 << " at " << job.spp << " spp done in "
+                  << std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() << "s" << std::endl;
+    }
+    return true;
+}
+
+#ifndef _WIN32
+// Serves one client connection at a time on a Unix domain socket at path, until a client sends "quit"
+template<typename Render>
+void serve_socket(const std::string &path, const RenderJob &defaults, Render render) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("socket path too long: " + path);
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) throw std::runtime_error("cannot create socket");
+    unlink(path.c_str());
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        close(listener);
+        throw std::runtime_error("cannot listen on " + path);
+    }
+    signal(SIGPIPE, SIG_IGN); // A client disconnecting mid-job must not kill the server
+    std::cerr << "Listening on " << path << std::endl;
+
+    for (bool running = true; running;) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) continue;
+        FILE* in = fdopen(connection, "r");
+        FILE* out = fdopen(dup(connection), "w");
+        running = serve_jobs(in, out, defaults, render);
+        fclose(in);
+        fclose(out);
+    }
+    close(listener);
+    unlink(path.c_str());
+}
+#endif
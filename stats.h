@@ -0,0 +1,130 @@
+#pragma once
+
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+
+#include "common.h"
+
+enum StatCounter {
+    CAMERA_RAYS,        // Camera rays and the specular rays continuing them
+    SHADOW_RAYS,
+    PHOTON_RAYS,        // One per photon bounce
+    PRIMITIVE_TESTS,    // Ray-triangle and ray-sphere tests
+    PHOTON_GATHERS,     // Nearest-photon queries into a kd-tree
+    KD_NODES_VISITED,
+    PHOTONS_EXAMINED,   // Photons on the gather's surface compared against the nearest found so far
+    CAUSTIC_HITS,       // Camera path hits on CAUSTIC surfaces
+    PHOTON_BRICK_LOADS, // Out-of-core photon map bricks read from disk
+    NUM_STAT_COUNTERS
+};
+
+const char* STAT_COUNTER_NAMES[NUM_STAT_COUNTERS] = {
+    "camera_rays", "shadow_rays", "photon_rays", "primitive_tests", "photon_gathers", "kd_nodes_visited", "photons_examined", "caustic_hits", "photon_brick_loads"
+};
+
+// Counters of one thread. Counting is a plain increment of thread-local memory, cheap enough to
+// stay on in every build; the totals are only summed when the report is written.
+struct ThreadStats {
+    uint64_t counts[NUM_STAT_COUNTERS] = {};
+    ThreadStats();
+    ~ThreadStats();
+};
+
+std::mutex stats_mutex;
+std::vector<ThreadStats*> live_thread_stats;
+uint64_t retired_stat_counts[NUM_STAT_COUNTERS] = {};
+thread_local ThreadStats thread_stats;
+
+ThreadStats::ThreadStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    live_thread_stats.push_back(this);
+}
+
+// Threads that end before the report, like the tile threads of --workers, hand their counts over
+ThreadStats::~ThreadStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) retired_stat_counts[i] += counts[i];
+    live_thread_stats.erase(std::find(live_thread_stats.begin(), live_thread_stats.end(), this));
+}
+
+inline void count_stat(StatCounter counter, uint64_t n = 1) {
+    thread_stats.counts[counter] += n;
+}
+
+// Sum over all threads; only exact while no parallel work is running
+std::vector<uint64_t> stat_totals() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    std::vector<uint64_t> totals(retired_stat_counts, retired_stat_counts + NUM_STAT_COUNTERS);
+    for (ThreadStats* stats : live_thread_stats) {
+        for (int i = 0; i < NUM_STAT_COUNTERS; i++) totals[i] += stats->counts[i];
+    }
+    return totals;
+}
+
+struct PhaseStats {
+    std::string name;
+    int calls = 0;
+    double wall_seconds = 0;
+    double cpu_seconds = 0;  // Process CPU time, summed over all threads
+};
+
+std::vector<PhaseStats> phase_stats; // In the order the phases first ran
+auto stats_start = std::chrono::steady_clock::now();
+
+// Adds the wall and CPU time from its construction to its destruction to the named phase. Phases
+// may nest and may run on several threads at once; overlapping phases each count all of the
+// process's CPU time while they run.
+class ScopedPhase {
+    public:
+        ScopedPhase(const char* given_name) : name(given_name) {}
+        ~ScopedPhase();
+        ScopedPhase(const ScopedPhase &) = delete;
+        ScopedPhase &operator=(const ScopedPhase &) = delete;
+    private:
+        const char* name;
+        std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+        std::clock_t cpu_start = std::clock();
+};
+
+ScopedPhase::~ScopedPhase() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto phase = std::find_if(phase_stats.begin(), phase_stats.end(), [&](const PhaseStats &p) { return p.name == name; });
+    if (phase == phase_stats.end()) phase = phase_stats.insert(phase_stats.end(), PhaseStats{name});
+    phase->calls++;
+    phase->wall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    phase->cpu_seconds += (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+}
+
+// JSON report of the settings, phase times and counters, with per-gather and per-ray averages
+void write_stats_report(const std::string &path, const std::vector<std::pair<std::string, double>> &settings) {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("cannot create " + path);
+    std::vector<uint64_t> totals = stat_totals();
+    auto ratio = [](uint64_t a, uint64_t b) { return b == 0 ? 0.0 : (double)a / b; };
+
+    file << std::setprecision(9) << "{\n  \"wall_seconds\": "
+         << std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start).count()
+         << ",\n  \"cpu_seconds\": " << (double)std::clock() / CLOCKS_PER_SEC
+         << ",\n  \"threads\": " << omp_get_max_threads() << ",\n  \"settings\": {";
+    for (size_t i = 0; i < settings.size(); i++) {
+        file << (i == 0 ? "\n" : ",\n") << "    \"" << settings[i].first << "\": " << settings[i].second;
+    }
+    file << "\n  },\n  \"phases\": [";
+    for (size_t i = 0; i < phase_stats.size(); i++) {
+        const PhaseStats &phase = phase_stats[i];
+        file << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << phase.name << "\", \"calls\": " << phase.calls
+             << ", \"wall_seconds\": " << phase.wall_seconds << ", \"cpu_seconds\": " << phase.cpu_seconds << "}";
+    }
+    file << "\n  ],\n  \"counters\": {";
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        file << (i == 0 ? "\n" : ",\n") << "    \"" << STAT_COUNTER_NAMES[i] << "\": " << totals[i];
+    }
+    uint64_t rays = totals[CAMERA_RAYS] + totals[SHADOW_RAYS] + totals[PHOTON_RAYS];
+    file << "\n  },\n  \"averages\": {"
+         << "\n    \"primitive_tests_per_ray\": " << ratio(totals[PRIMITIVE_TESTS], rays)
+         << ",\n    \"kd_nodes_visited_per_gather\": " << ratio(totals[KD_NODES_VISITED], totals[PHOTON_GATHERS])
+         << ",\n    \"photons_examined_per_gather\": " << ratio(totals[PHOTONS_EXAMINED], totals[PHOTON_GATHERS])
+         << "\n  }\n}\n";
+    if (!file) throw std::runtime_error("failed writing " + path);
+}